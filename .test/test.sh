@@ -1,5 +1,5 @@
 #!/bin/bash
-expected=6
+expected=29
 
 .test/run-hawx > .test/hawx.out
 passed=$(grep PASSED .test/hawx.out | wc -l)
@@ -0,0 +1,329 @@
+//
+// block cache, kept by the disk driver in front of the device.
+// unlike xv6's buffer cache it holds no locks and no references:
+// it is only a set of block contents, indexed by block id, which
+// the driver copies in and out of with interrupts off.
+//
+// blocks are found through a hash table of chains, and evicted
+// with CLOCK: the hand sweeps the blocks in order, giving a block
+// that has been used since the last sweep another chance, and
+// taking the first one that hasn't. dirty blocks, and blocks being
+// written back, are never evicted.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "disk.h"
+#include "bcache.h"
+#include "string.h"
+#include "mem.h"
+#include "console.h"
+
+#define NBHASH (2 * NBCACHE)
+
+struct bentry
+{
+  uint64 blockid;
+  char valid;    // does this hold a block?
+  char ref;      // used since the hand last passed
+  char dirty;    // newer than the disk
+  char flushing; // being written back
+  uint64 dirtied; // r_time() when it last became dirty
+  int next;      // next on the hash chain, or -1
+  char *data;
+};
+
+static struct
+{
+  struct bentry e[NBCACHE];
+  int hash[NBHASH]; // first entry on each chain, or -1
+  int hand;         // CLOCK hand
+  int ndirty;       // entries dirty or flushing
+  int nflushing;    // entries flushing
+  uint64 sweep;     // block after the last one written back
+  uint32 gen;       // see bcache_gen
+} bcache;
+
+void
+bcache_init(void)
+{
+  char *page = 0;
+
+  for(int i = 0; i < NBHASH; i++)
+    bcache.hash[i] = -1;
+  for(int i = 0; i < NBCACHE; i++){
+    if(i % (PGSIZE / BSIZE) == 0 && (page = vm_page_alloc()) == 0)
+      panic("bcache_init");
+    bcache.e[i].data = page + (i % (PGSIZE / BSIZE)) * BSIZE;
+    bcache.e[i].next = -1;
+  }
+}
+
+// the entry holding blockid, or -1.
+static int
+lookup(uint64 blockid)
+{
+  int i = bcache.hash[blockid % NBHASH];
+
+  while(i >= 0 && bcache.e[i].blockid != blockid)
+    i = bcache.e[i].next;
+  return i;
+}
+
+// take entry i off its hash chain, and empty it.
+static void
+drop(int i)
+{
+  int *pp = &bcache.hash[bcache.e[i].blockid % NBHASH];
+
+  while(*pp != i)
+    pp = &bcache.e[*pp].next;
+  *pp = bcache.e[i].next;
+  bcache.e[i].valid = 0;
+}
+
+// pick an entry to reuse for blockid, and put it on its chain.
+// returns -1 if every entry is dirty or being written back.
+static int
+take(uint64 blockid)
+{
+  // two laps, in case the first only clears reference bits.
+  for(int n = 0; n < 2 * NBCACHE; n++){
+    int i = bcache.hand;
+    struct bentry *e = &bcache.e[i];
+
+    bcache.hand = (bcache.hand + 1) % NBCACHE;
+    if(e->dirty || e->flushing)
+      continue;
+    if(e->valid && e->ref){
+      e->ref = 0;
+      continue;
+    }
+
+    if(e->valid)
+      drop(i);
+    e->blockid = blockid;
+    e->valid = 1;
+    e->ref = 0;
+    e->next = bcache.hash[blockid % NBHASH];
+    bcache.hash[blockid % NBHASH] = i;
+    return i;
+  }
+  return -1;
+}
+
+// set entry i's dirty bit, keeping count.
+static void
+set_dirty(int i, int dirty)
+{
+  struct bentry *e = &bcache.e[i];
+
+  if(!e->dirty && !e->flushing && dirty)
+    bcache.ndirty++;
+  else if(e->dirty && !e->flushing && !dirty)
+    bcache.ndirty--;
+  if(!e->dirty && dirty)
+    e->dirtied = r_time();
+  e->dirty = dirty;
+}
+
+// is entry i dirty and not being written back?
+static int
+waiting(int i)
+{
+  return i >= 0 && bcache.e[i].dirty && !bcache.e[i].flushing;
+}
+
+char *
+bcache_get(uint64 blockid)
+{
+  int i = lookup(blockid);
+
+  if(i < 0)
+    return 0;
+  bcache.e[i].ref = 1;
+  return bcache.e[i].data;
+}
+
+int
+bcache_cached(uint64 blockid)
+{
+  return lookup(blockid) >= 0;
+}
+
+char *
+bcache_put(uint64 blockid, int dirty)
+{
+  int i = lookup(blockid);
+
+  bcache.gen++;
+  if(i < 0 && (i = take(blockid)) < 0)
+    return 0;
+  bcache.e[i].ref = 1;
+  set_dirty(i, dirty);
+  return bcache.e[i].data;
+}
+
+void
+bcache_fill(uint64 blockid, char *data, uint32 gen)
+{
+  int i;
+
+  if(gen != bcache.gen || lookup(blockid) >= 0)
+    return;
+  if((i = take(blockid)) < 0)
+    return;
+  // the reference bit stays clear, so that a long run of reads
+  // read once doesn't push out blocks that are used again.
+  memmove(bcache.e[i].data, data, BSIZE);
+}
+
+uint32
+bcache_gen(void)
+{
+  return bcache.gen;
+}
+
+void
+bcache_invalidate(uint64 blockid)
+{
+  int i = lookup(blockid);
+
+  bcache.gen++;
+  // a dirty block was put after whatever failed, and is newer.
+  if(i >= 0 && !bcache.e[i].dirty && !bcache.e[i].flushing)
+    drop(i);
+}
+
+void
+bcache_clear(void)
+{
+  if(bcache.ndirty != 0)
+    panic("bcache_clear");
+  bcache.gen++;
+  for(int i = 0; i < NBCACHE; i++)
+    if(bcache.e[i].valid)
+      drop(i);
+}
+
+int
+bcache_dirty(uint64 blockid)
+{
+  return waiting(lookup(blockid));
+}
+
+int
+bcache_expired(uint64 expired)
+{
+  if(bcache.ndirty == 0)
+    return 0;
+  for(int i = 0; i < NBCACHE; i++)
+    if(waiting(i) && bcache.e[i].dirtied < expired)
+      return 1;
+  return 0;
+}
+
+int
+bcache_next_run(uint64 *blockid, int max, uint64 expired)
+{
+  struct bentry *oldest = 0, *up = 0, *low = 0;
+  uint64 start, b;
+  int n;
+
+  if(bcache.ndirty == 0)
+    return 0;
+  for(int i = 0; i < NBCACHE; i++){
+    struct bentry *e = &bcache.e[i];
+    if(!waiting(i))
+      continue;
+    if(!oldest || e->dirtied < oldest->dirtied)
+      oldest = e;
+    if(!low || e->blockid < low->blockid)
+      low = e;
+    if(e->blockid >= bcache.sweep && (!up || e->blockid < up->blockid))
+      up = e;
+  }
+  if(!oldest)
+    return 0;
+
+  if(oldest->dirtied < expired)
+    start = oldest->blockid;
+  else
+    start = up ? up->blockid : low->blockid;
+
+  // take in the dirty blocks just before start as well, since they
+  // cost no more to write along with it.
+  b = start;
+  while(b > 0 && start - b + 1 < max && waiting(lookup(b - 1)))
+    b--;
+  for(n = 0; n < max && waiting(lookup(b + n)); n++)
+    ;
+  *blockid = b;
+  return n;
+}
+
+void
+bcache_flush(uint64 blockid, char *buf)
+{
+  int i = lookup(blockid);
+
+  if(!waiting(i))
+    panic("bcache_flush");
+  memmove(buf, bcache.e[i].data, BSIZE);
+  bcache.e[i].dirty = 0;
+  bcache.e[i].flushing = 1;
+  bcache.nflushing++;
+  bcache.sweep = blockid + 1;
+}
+
+void
+bcache_flushed(uint64 blockid, int ok)
+{
+  int i = lookup(blockid);
+
+  if(i < 0 || !bcache.e[i].flushing)
+    panic("bcache_flushed");
+  bcache.e[i].flushing = 0;
+  bcache.nflushing--;
+  // a failed write leaves the block dirty, to be tried again.
+  if(!ok)
+    bcache.e[i].dirty = 1;
+  if(!bcache.e[i].dirty)
+    bcache.ndirty--;
+}
+
+int
+bcache_drop_dirty(void)
+{
+  int n = 0;
+
+  bcache.gen++;
+  for(int i = 0; i < NBCACHE; i++){
+    if(!waiting(i))
+      continue;
+    set_dirty(i, 0);
+    drop(i);
+    n++;
+  }
+  return n;
+}
+
+int
+bcache_flushing(uint64 blockid)
+{
+  int i = lookup(blockid);
+
+  return i >= 0 && bcache.e[i].flushing;
+}
+
+int
+bcache_ndirty(void)
+{
+  return bcache.ndirty;
+}
+
+int
+bcache_nwaiting(void)
+{
+  return bcache.ndirty - bcache.nflushing;
+}
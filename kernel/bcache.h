@@ -0,0 +1,121 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "types.h"
+
+// blocks held by the cache. BCACHE=n on the make command line.
+#ifndef NBCACHE
+#define NBCACHE 64
+#endif
+
+/*
+ * The block cache in front of the disk driver. It only keeps block
+ * contents; the driver decides what goes in and when dirty blocks
+ * are written back. Blocks are BSIZE bytes.
+ */
+
+/*
+ * Allocate the cache's blocks. Called by virtio_disk_init.
+ */
+void bcache_init(void);
+
+/*
+ * Look up a block.
+ * Returns: Its cached contents, or 0 if it is not cached.
+ */
+char *bcache_get(uint64 blockid);
+
+/*
+ * Is a block cached? Unlike bcache_get, this doesn't count as a use.
+ */
+int bcache_cached(uint64 blockid);
+
+/*
+ * Make room for new contents of a block, which is about to be
+ * written to the disk, or just marked dirty if it is being
+ * absorbed by a write-back cache. The caller copies the block in.
+ * Returns: Where to put the contents, or 0 if there is no room
+ *          because every block is dirty. Any old contents are
+ *          forgotten either way.
+ */
+char *bcache_put(uint64 blockid, int dirty);
+
+/*
+ * Offer the contents of a block that was read from the disk. They
+ * are dropped if the block is already cached, or if anything was
+ * put since gen, a bcache_gen() from before the read started, as
+ * they may then be older than a write.
+ */
+void bcache_fill(uint64 blockid, char *data, uint32 gen);
+
+/*
+ * A number that changes whenever a block is put or dropped.
+ */
+uint32 bcache_gen(void);
+
+/*
+ * Forget a block, such as one whose write failed.
+ */
+void bcache_invalidate(uint64 blockid);
+
+/*
+ * Forget every block. There must be none dirty.
+ */
+void bcache_clear(void);
+
+/*
+ * Is a block dirty, and not yet being written back?
+ */
+int bcache_dirty(uint64 blockid);
+
+/*
+ * Has any dirty block waited since before expired, an r_time()?
+ */
+int bcache_expired(uint64 expired);
+
+/*
+ * Pick the next dirty blocks to write back: a run of up to max of
+ * them, one after the other. The run is around the oldest dirty
+ * block if that has waited since before expired. Otherwise it is
+ * the next one up from the last block written back, going round
+ * to the lowest after the highest, as an elevator would.
+ * Returns: The number of blocks, with the first in *blockid, or 0
+ *          if no dirty block is waiting to be written.
+ */
+int bcache_next_run(uint64 *blockid, int max, uint64 expired);
+
+/*
+ * Copy a dirty block to buf to be written back, and mark it as
+ * being written back, which it stays until bcache_flushed.
+ */
+void bcache_flush(uint64 blockid, char *buf);
+
+/*
+ * Finish a write-back started by bcache_flush. The block is
+ * clean if the write worked and it was not put again meanwhile.
+ */
+void bcache_flushed(uint64 blockid, int ok);
+
+/*
+ * Forget every dirty block that is not being written back, losing
+ * what was written to it.
+ * Returns: The number of blocks forgotten.
+ */
+int bcache_drop_dirty(void);
+
+/*
+ * Is a block being written back?
+ */
+int bcache_flushing(uint64 blockid);
+
+/*
+ * Returns: The number of blocks dirty or being written back.
+ */
+int bcache_ndirty(void);
+
+/*
+ * Returns: The number of dirty blocks not yet being written back.
+ */
+int bcache_nwaiting(void);
+
+#endif // BCACHE_H
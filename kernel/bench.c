@@ -0,0 +1,840 @@
+//
+// disk benchmarks. these are run at boot after the unit tests
+// when the kernel is built with BENCH=1 (see make bench).
+// times come from the CLINT's mtime, which qemu runs at 10MHz.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "console.h"
+#include "port.h"
+#include "disk.h"
+#include "bcache.h"
+#include "virtio.h"
+#include "string.h"
+#include "bench.h"
+
+#define TICKS_PER_MS 10000 // r_time() ticks per millisecond
+
+// blocks read by each throughput run.
+#define BENCH_BLOCKS 2048
+
+// data ports share a message port in groups of this many, so
+// a group's responses always fit in its message port.
+#define BENCH_GROUP 64
+
+// the most reads kept in flight. each one needs its own data
+// port, and the message ports need a few more.
+#define BENCH_MAXWIN (NPORT - PORT_DISKSTAT - 1 - NPORT / BENCH_GROUP)
+
+static int bench_slot[BENCH_BLOCKS];      // block id -> slot reading it
+static int bench_dp[BENCH_MAXWIN];        // slot -> data port
+static int bench_dm[NPORT / BENCH_GROUP]; // group -> message port
+static int bench_idle[BENCH_MAXWIN];      // slots with no read in flight
+static char bench_buf[BSIZE];
+static struct disk_stats before, after;
+
+// read BENCH_BLOCKS blocks with up to window reads in flight.
+// returns the elapsed time in ticks, or 0 if any read failed.
+static uint64
+bench_reads(int window)
+{
+  char resp[10];
+  int nidle = 0;
+  int issued = 0;
+  int done = 0;
+  int failed = 0;
+  int ngroup = (window + BENCH_GROUP - 1) / BENCH_GROUP;
+  uint64 start;
+
+  for(int g = 0; g < ngroup; g++)
+    bench_dm[g] = port_acquire(-1, 0);
+  for(int s = window - 1; s >= 0; s--){
+    bench_dp[s] = port_acquire(-1, 0);
+    bench_idle[nidle++] = s;
+  }
+
+  // the ports are only touched with interrupts off, since the
+  // disk interrupt writes to them too. the window at the bottom
+  // of the loop is where completions come in.
+  intr_off();
+  start = r_time();
+  while(done < BENCH_BLOCKS){
+    // keep every idle slot busy while there is room for commands.
+    while(nidle > 0 && issued < BENCH_BLOCKS &&
+          port_size(PORT_DISKCMD) - ports[PORT_DISKCMD].count >= 16){
+      int s = bench_idle[--nidle];
+      bench_slot[issued] = s;
+      pprintf(PORT_DISKCMD, "R%7d%4d%4d", issued, bench_dp[s],
+              bench_dm[s / BENCH_GROUP]);
+      issued++;
+    }
+    virtio_disk_start();
+
+    // collect responses and free up their slots.
+    for(int g = 0; g < ngroup; g++){
+      while(ports[bench_dm[g]].count >= 9){
+        port_read(bench_dm[g], resp, 9);
+        resp[9] = '\0';
+        int s = bench_slot[atoi(resp + 2)];
+        if(resp[1] != 'S')
+          failed++;
+        port_read(bench_dp[s], bench_buf, BSIZE);
+        bench_idle[nidle++] = s;
+        done++;
+      }
+    }
+
+    intr_on();
+    intr_off();
+  }
+  uint64 elapsed = r_time() - start;
+  intr_on();
+
+  for(int s = 0; s < window; s++)
+    port_close(bench_dp[s]);
+  for(int g = 0; g < ngroup; g++)
+    port_close(bench_dm[g]);
+
+  return failed ? 0 : elapsed;
+}
+
+// print n per request, to a hundredth.
+static void
+print_per_req(char *name, uint64 n, uint64 nreq)
+{
+  int x = n * 100 / nreq;
+  printf(" %d.%d%d %s/req", x / 100, x / 10 % 10, x % 10, name);
+}
+
+// read throughput as the number of requests in flight grows
+// towards the queue size.
+static void
+bench_qdepth(void)
+{
+  virtio_disk_stats(&before);
+  printf("disk read throughput, %s ring, queue size at most %d\n",
+         (before.features >> VIRTIO_F_RING_PACKED) & 1 ? "packed" : "split",
+         NUM);
+  for(int window = 8; window <= 256; window *= 2){
+    int w = window < BENCH_MAXWIN ? window : BENCH_MAXWIN;
+    virtio_disk_stats(&before);
+    uint64 t = bench_reads(w);
+    virtio_disk_stats(&after);
+    if(t == 0){
+      printf("  in flight %3d: FAILED\n", w);
+      continue;
+    }
+    int ms = t / TICKS_PER_MS;
+    if(ms == 0)
+      ms = 1;
+    printf("  in flight %3d: %5d ms, %6d KiB/s,", w, ms,
+           BENCH_BLOCKS * (BSIZE / 1024) * 1000 / ms);
+    print_per_req("notifies", after.notifies - before.notifies,
+                  after.requests - before.requests);
+    print_per_req("irqs", after.interrupts - before.interrupts,
+                  after.requests - before.requests);
+    printf("\n");
+  }
+}
+
+// requests in flight for bench_queues.
+#define BENCH_QWIN 64
+
+// read throughput as commands are spread over more virtqueues,
+// standing in for that many harts each with a queue of its own.
+static void
+bench_queues(void)
+{
+  virtio_disk_stats(&before);
+  printf("disk read throughput, %d in flight, %d device queues\n",
+         BENCH_QWIN, (int)before.queues);
+  for(int n = 1; n <= NQUEUE; n *= 2){
+    int used = virtio_disk_spread(n);
+    if(used < n){
+      printf("  queues %d: more than the device has\n", n);
+      break;
+    }
+    virtio_disk_stats(&before);
+    uint64 t = bench_reads(BENCH_QWIN);
+    virtio_disk_stats(&after);
+    if(t == 0){
+      printf("  queues %d: FAILED\n", n);
+      continue;
+    }
+    int ms = t / TICKS_PER_MS;
+    if(ms == 0)
+      ms = 1;
+    printf("  queues %d: %5d ms, %6d KiB/s,", n, ms,
+           BENCH_BLOCKS * (BSIZE / 1024) * 1000 / ms);
+    print_per_req("notifies", after.notifies - before.notifies,
+                  after.requests - before.requests);
+    printf("\n");
+  }
+  virtio_disk_spread(0);
+}
+
+// commands sent by each message format run.
+#define BENCH_MSGS 1000
+
+// print ticks per command, to a tenth of a tick.
+static void
+print_per_msg(char *name, uint64 t)
+{
+  printf("  %s: %d.%d ticks per command\n", name,
+         (int)(t / BENCH_MSGS), (int)(t * 10 / BENCH_MSGS % 10));
+}
+
+// cost of getting a command to the driver and its response back,
+// in the ASCII and binary forms. the reads go to a data port that
+// is not empty, so the driver fails them without using the disk and
+// all that is measured is formatting, parsing and the port copies.
+// the cost of formatting alone is measured first, on a port that
+// only the benchmark reads.
+static void
+bench_msgfmt(void)
+{
+  struct disk_bmsg cmd;
+  struct disk_bresp bresp;
+  char resp[10];
+  char msg[16];
+  uint64 start, t;
+  int dp, dm;
+
+  dp = port_acquire(-1, 0);
+  dm = port_acquire(-1, 0);
+  port_write(dp, "x", 1);
+  printf("disk command format, %d failed reads\n", BENCH_MSGS);
+
+  start = r_time();
+  for(int i = 0; i < BENCH_MSGS; i++){
+    pprintf(dm, "W%7d%4d%4d", i, dp, dm);
+    if(port_read(dm, msg, sizeof(msg)) != 16 || msg[0] != 'W')
+      printf("  bad pprintf output\n");
+  }
+  t = r_time() - start;
+  print_per_msg("pprintf", t);
+
+  start = r_time();
+  for(int i = 0; i < BENCH_MSGS; i++){
+    pprintf(PORT_DISKCMD, "R%7d%4d%4d", i, dp, dm);
+    virtio_disk_start();
+    port_read(dm, resp, 9);
+    resp[9] = '\0';
+    if(resp[1] != 'F' || atoi(resp + 2) != i)
+      printf("  bad ASCII response\n");
+  }
+  t = r_time() - start;
+  print_per_msg("ASCII ", t);
+
+  start = r_time();
+  for(int i = 0; i < BENCH_MSGS; i++){
+    cmd.magic = DISK_BMSG_MAGIC;
+    cmd.mode = 'R';
+    cmd.nblocks = 1;
+    cmd.data_port = dp;
+    cmd.msg_port = dm;
+    cmd.tag = i;
+    cmd.blockid = i;
+    port_write(PORT_DISKCMD, (char *) &cmd, sizeof(cmd));
+    virtio_disk_start();
+    port_read(dm, (char *) &bresp, sizeof(bresp));
+    if(bresp.status != 'F' || bresp.tag != i)
+      printf("  bad binary response\n");
+  }
+  t = r_time() - start;
+  print_per_msg("binary", t);
+
+  port_close(dp);
+  port_close(dm);
+}
+
+// reads issued by each completion mode run.
+#define BENCH_LAT 500
+
+// print the buckets of a histogram of n buckets that have anything
+// in them, as the bucket's lowest value and the count.
+static void
+print_hist(uint64 *b, uint64 *a, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(a[i] != b[i])
+      printf(" %d:%d", 1 << i, (int)(a[i] - b[i]));
+  printf("\n");
+}
+
+// latency of reads issued one at a time, with completions reaped
+// by the interrupt handler, by polling, or whichever the driver
+// picks. histogram buckets are in ticks.
+static void
+bench_poll(void)
+{
+  static char *names[] = { "adaptive", "interrupt", "poll" };
+  int modes[] = { DISK_MODE_INTR, DISK_MODE_POLL, DISK_MODE_ADAPTIVE };
+  int dp, dm;
+  char resp[10];
+
+  dp = port_acquire(-1, 0);
+  dm = port_acquire(-1, 0);
+  printf("disk read latency, %d reads one at a time\n", BENCH_LAT);
+
+  for(int m = 0; m < 3; m++){
+    virtio_disk_mode(modes[m]);
+    virtio_disk_stats(&before);
+    uint64 start = r_time();
+    for(int i = 0; i < BENCH_LAT; i++){
+      intr_off();
+      pprintf(PORT_DISKCMD, "R%7d%4d%4d", i, dp, dm);
+      virtio_disk_start();
+      while(ports[dm].count < 9){
+        // a window for the interrupt, if the driver wants one.
+        intr_on();
+        intr_off();
+        if(modes[m] != DISK_MODE_INTR)
+          virtio_disk_poll();
+      }
+      port_read(dm, resp, 9);
+      port_read(dp, bench_buf, BSIZE);
+      intr_on();
+    }
+    uint64 t = r_time() - start;
+    virtio_disk_stats(&after);
+
+    printf("  %s: %d ticks per read, %d polled, %d switches\n",
+           names[modes[m]], (int)(t / BENCH_LAT),
+           (int)(after.polled - before.polled),
+           (int)(after.switches - before.switches));
+    printf("    interrupt:");
+    print_hist(before.lat_intr, after.lat_intr, DISK_LAT_BUCKETS);
+    printf("    poll:");
+    print_hist(before.lat_poll, after.lat_poll, DISK_LAT_BUCKETS);
+  }
+  virtio_disk_mode(DISK_MODE_ADAPTIVE);
+
+  port_close(dp);
+  port_close(dm);
+}
+
+// commands timed by bench_cache, spread over this many blocks.
+#define BENCH_HOTOPS 1000
+#define BENCH_HOT 16
+
+// send one 'R', 'W' or 'F' command for blockid and wait for the
+// answer. returns its status.
+static char
+bench_one(char mode, int blockid, int dp, int dm)
+{
+  char resp[10];
+
+  intr_off();
+  if(mode == 'W')
+    port_write(dp, bench_buf, BSIZE);
+  pprintf(PORT_DISKCMD, "%c%7d%4d%4d", mode, blockid, dp, dm);
+  virtio_disk_start();
+  while(ports[dm].count < 9){
+    intr_on();
+    intr_off();
+    virtio_disk_poll();
+  }
+  port_read(dm, resp, 9);
+  if(mode == 'R')
+    port_read(dp, bench_buf, BSIZE);
+  intr_on();
+  return resp[1];
+}
+
+// writes and then reads of a few hot blocks, one at a time, with
+// the block cache off and in each of its modes. the time to write
+// back what write-back mode left dirty is counted separately.
+static void
+bench_cache(void)
+{
+  static char *names[] = { "write-through", "write-back", "off" };
+  int modes[] = { DISK_CACHE_OFF, DISK_CACHE_WRITETHROUGH,
+                  DISK_CACHE_WRITEBACK };
+  uint64 start, tw, tr, tf;
+  int dp, dm, ok;
+
+  dp = port_acquire(-1, 0);
+  dm = port_acquire(-1, 0);
+  printf("block cache of %d blocks, %d writes then %d reads of %d blocks\n",
+         NBCACHE, BENCH_HOTOPS, BENCH_HOTOPS, BENCH_HOT);
+
+  for(int m = 0; m < 3; m++){
+    virtio_disk_cache(modes[m]);
+    virtio_disk_stats(&before);
+    ok = 1;
+    start = r_time();
+    for(int i = 0; i < BENCH_HOTOPS; i++)
+      ok &= bench_one('W', 100 + i % BENCH_HOT, dp, dm) == 'S';
+    tw = r_time() - start;
+    start = r_time();
+    for(int i = 0; i < BENCH_HOTOPS; i++)
+      ok &= bench_one('R', 100 + i % BENCH_HOT, dp, dm) == 'S';
+    tr = r_time() - start;
+    start = r_time();
+    virtio_disk_cache(DISK_CACHE_OFF);
+    tf = r_time() - start;
+    virtio_disk_stats(&after);
+
+    if(!ok){
+      printf("  %s: FAILED\n", names[modes[m]]);
+      continue;
+    }
+    printf("  %s: %d ticks per write, %d per read, %d to write back\n",
+           names[modes[m]], (int)(tw / BENCH_HOTOPS),
+           (int)(tr / BENCH_HOTOPS), (int)tf);
+    printf("    %d hits, %d misses, %d absorbed, %d written back\n",
+           (int)(after.cache_hits - before.cache_hits),
+           (int)(after.cache_misses - before.cache_misses),
+           (int)(after.cache_absorbed - before.cache_absorbed),
+           (int)(after.cache_writebacks - before.cache_writebacks));
+  }
+
+  port_close(dp);
+  port_close(dm);
+}
+
+// writes timed by each bench_wcache run, and how many of them go
+// between flushes (0 for none).
+#define BENCH_WCWRITES 1000
+static int bench_flush[] = { 0, 100, 10, 1 };
+#define BENCH_NFLUSH (sizeof(bench_flush) / sizeof(bench_flush[0]))
+
+// writes one at a time with the device's write cache off and on,
+// and with an 'F' after every so many of them.
+static void
+bench_wcache(void)
+{
+  int dp, dm, ok;
+  uint64 start, t;
+
+  dp = port_acquire(-1, 0);
+  dm = port_acquire(-1, 0);
+  printf("device write cache, %d writes one at a time\n", BENCH_WCWRITES);
+
+  for(int on = 0; on < 2; on++){
+    // what is cached goes to the disk before the cache is turned off.
+    bench_one('F', 0, 0, dm);
+    if(virtio_disk_wcache(on) != on){
+      printf("  cache %s: not supported\n", on ? "on" : "off");
+      continue;
+    }
+    for(int f = 0; f < BENCH_NFLUSH; f++){
+      int every = bench_flush[f];
+      virtio_disk_stats(&before);
+      ok = 1;
+      start = r_time();
+      for(int i = 0; i < BENCH_WCWRITES; i++){
+        ok &= bench_one('W', 100 + i % BENCH_HOT, dp, dm) == 'S';
+        if(every && (i + 1) % every == 0)
+          ok &= bench_one('F', 0, 0, dm) == 'S';
+      }
+      t = r_time() - start;
+      virtio_disk_stats(&after);
+      if(!ok){
+        printf("  cache %s: FAILED\n", on ? "on" : "off");
+        continue;
+      }
+      printf("  cache %s, ", on ? "on" : "off");
+      if(every)
+        printf("flush every %d: ", every);
+      else
+        printf("no flushes: ");
+      printf("%d ticks per write, %d flushes\n",
+             (int)(t / BENCH_WCWRITES),
+             (int)(after.flushes - before.flushes));
+    }
+  }
+
+  port_close(dp);
+  port_close(dm);
+}
+
+// writes made by each bench_coalesce run, to blocks from
+// BENCH_WBASE on.
+#define BENCH_WRITES 2000
+#define BENCH_WBASE 1000
+
+static uint32 bench_seed = 1;
+
+// a pseudo-random number below n.
+static int
+bench_rand(int n)
+{
+  bench_seed = bench_seed * 1103515245 + 12345;
+  return (bench_seed >> 16) % n;
+}
+
+// how well a write-back cache merges and drops writes, for writes
+// spread over 1024 blocks at random, and in runs of 8 neighbouring
+// blocks over 256 blocks.
+static void
+bench_coalesce(void)
+{
+  static char *names[] = { "random", "clustered" };
+  uint64 start, t;
+  int dp, dm, ok, b, reqs;
+
+  dp = port_acquire(-1, 0);
+  dm = port_acquire(-1, 0);
+  printf("write-back merging, %d writes\n", BENCH_WRITES);
+
+  for(int m = 0; m < 2; m++){
+    virtio_disk_cache(DISK_CACHE_WRITEBACK);
+    virtio_disk_stats(&before);
+    ok = 1;
+    b = 0;
+    start = r_time();
+    for(int i = 0; i < BENCH_WRITES; i++){
+      if(m == 0)
+        b = bench_rand(1024);
+      else if(i % 8 == 0)
+        b = bench_rand(256 / 8) * 8;
+      else
+        b++;
+      ok &= bench_one('W', BENCH_WBASE + b, dp, dm) == 'S';
+    }
+    // leaving write-back mode writes back the rest.
+    virtio_disk_cache(DISK_CACHE_OFF);
+    t = r_time() - start;
+    virtio_disk_stats(&after);
+
+    if(!ok){
+      printf("  %s: FAILED\n", names[m]);
+      continue;
+    }
+    reqs = after.writeback_reqs - before.writeback_reqs;
+    printf("  %s: %d ticks per write, %d superseded,", names[m],
+           (int)(t / BENCH_WRITES),
+           (int)(after.cache_superseded - before.cache_superseded));
+    printf(" %d blocks written back in %d requests,",
+           (int)(after.cache_writebacks - before.cache_writebacks), reqs);
+    print_per_req("blocks", after.cache_writebacks - before.cache_writebacks,
+                  reqs ? reqs : 1);
+    printf("\n");
+  }
+
+  port_close(dp);
+  port_close(dm);
+}
+
+// blocks read by bench_readahead.
+#define BENCH_SEQ 1000
+
+// a reader going through the disk in order, one block at a time,
+// with read-ahead into the block cache off and on.
+static void
+bench_readahead(void)
+{
+  uint64 start, t;
+  int dp, dm, ok;
+
+  dp = port_acquire(-1, 0);
+  dm = port_acquire(-1, 0);
+  printf("sequential reads, %d blocks one at a time\n", BENCH_SEQ);
+
+  for(int on = 0; on < 2; on++){
+    // start each run with an empty cache.
+    virtio_disk_cache(DISK_CACHE_OFF);
+    virtio_disk_cache(DISK_CACHE_WRITETHROUGH);
+    virtio_disk_readahead(on ? DISK_READAHEAD : 0);
+    virtio_disk_stats(&before);
+    ok = 1;
+    start = r_time();
+    for(int i = 0; i < BENCH_SEQ; i++)
+      ok &= bench_one('R', i, dp, dm) == 'S';
+    t = r_time() - start;
+    virtio_disk_stats(&after);
+
+    if(!ok){
+      printf("  read-ahead %s: FAILED\n", on ? "on" : "off");
+      continue;
+    }
+    printf("  read-ahead %s: %d ticks per read, %d hits, %d read ahead\n",
+           on ? "on" : "off", (int)(t / BENCH_SEQ),
+           (int)(after.cache_hits - before.cache_hits),
+           (int)(after.readahead - before.readahead));
+  }
+  virtio_disk_cache(DISK_CACHE_OFF);
+
+  port_close(dp);
+  port_close(dm);
+}
+
+// alloc/free cycles timed at each depth.
+#define BENCH_ALLOCS 100000
+
+// cost of allocating and freeing a request's descriptors as the
+// number of descriptors in use grows.
+static void
+bench_alloc(void)
+{
+  printf("descriptor alloc/free, %d cycles\n", BENCH_ALLOCS);
+  for(int depth = 8; depth <= 1024; depth *= 2){
+    uint64 t = virtio_disk_bench_alloc(depth, BENCH_ALLOCS);
+    if(t == 0){
+      printf("  depth %4d: deeper than the queue\n", depth);
+      continue;
+    }
+    printf("  depth %4d: %d ns per cycle\n", depth,
+           (int)(t * (1000000 / TICKS_PER_MS) / BENCH_ALLOCS));
+  }
+}
+
+// ask for the stats on PORT_DISKSTAT, the way a program without
+// access to the driver's memory would, answered on port dm.
+static void
+query_stats(struct disk_stats *st, int dm)
+{
+  intr_off();
+  pprintf(PORT_DISKSTAT, "S%4d", dm);
+  while(ports[dm].count < sizeof(*st)){
+    virtio_disk_start();
+    intr_on();
+    intr_off();
+  }
+  port_read(dm, (char *) st, sizeof(*st));
+  intr_on();
+}
+
+// what the stats port shows of a run of reads with many in flight:
+// how long commands wait to be submitted, and how deep the ring is.
+static void
+bench_stats(void)
+{
+  int dm = port_acquire(-1, 0);
+  int w = 64 < BENCH_MAXWIN - 1 ? 64 : BENCH_MAXWIN - 1;
+
+  printf("disk stats port, %d reads with %d in flight\n",
+         BENCH_BLOCKS, w);
+  query_stats(&before, dm);
+  uint64 t = bench_reads(w);
+  query_stats(&after, dm);
+  if(t == 0)
+    printf("  FAILED\n");
+  printf("  %d requests, %d KB read, %d failed, %d stalls\n",
+         (int)(after.requests - before.requests),
+         (int)((after.bytes_read - before.bytes_read) / 1024),
+         (int)(after.failures - before.failures),
+         (int)(after.stalls - before.stalls));
+  printf("    queued:");
+  print_hist(before.lat_queue, after.lat_queue, DISK_LAT_BUCKETS);
+  printf("    depth:");
+  print_hist(before.depth, after.depth, DISK_DEPTH_BUCKETS);
+  port_close(dm);
+}
+
+// blocks zeroed by each bench_zero run, from BENCH_WBASE on.
+#define BENCH_ZBLOCKS 1024
+
+// zeroing a range of blocks by streaming zero blocks through 'w'
+// commands, with a 'z' command in place of each 'w', and with a
+// single 'z' for the whole range.
+static void
+bench_zero(void)
+{
+  static char *names[] = { "'w' of zeroes", "'z' per run", "one 'z'" };
+  int dp, dm, ok;
+  uint64 start, t;
+  char resp[10];
+
+  dp = port_acquire(-1, 0);
+  dm = port_acquire(-1, 0);
+  memset(bench_buf, 0, BSIZE);
+  printf("zeroing %d blocks, %d at a time\n", BENCH_ZBLOCKS, MAXRUN);
+
+  for(int m = 0; m < 3; m++){
+    int n = m == 2 ? BENCH_ZBLOCKS : MAXRUN;
+    virtio_disk_stats(&before);
+    ok = 1;
+    start = r_time();
+    for(int b = 0; b < BENCH_ZBLOCKS; b += n){
+      intr_off();
+      pprintf(PORT_DISKCMD, "%c%7d%4d%4d%4d", m == 0 ? 'w' : 'z',
+              BENCH_WBASE + b, n, dp, dm);
+      if(m == 0)
+        for(int i = 0; i < n; i++)
+          for(int k = 0; k < BSIZE; k += port_write(dp, bench_buf + k,
+                                                    BSIZE - k))
+            virtio_disk_start();
+      virtio_disk_start();
+      while(ports[dm].count < 9){
+        intr_on();
+        intr_off();
+        virtio_disk_poll();
+      }
+      port_read(dm, resp, 9);
+      ok &= resp[1] == 'S';
+      intr_on();
+    }
+    t = r_time() - start;
+    virtio_disk_stats(&after);
+    if(!ok){
+      printf("  %s: FAILED\n", names[m]);
+      continue;
+    }
+    printf("  %s: %d ticks, %d requests\n", names[m], (int)t,
+           (int)(after.requests - before.requests));
+  }
+
+  port_close(dp);
+  port_close(dm);
+}
+
+// blocks read by each bench_runs run, from BENCH_WBASE on.
+#define BENCH_RBLOCKS 512
+static int bench_run[] = { 1, 4, MAXRUN };
+#define BENCH_NRUN (sizeof(bench_run) / sizeof(bench_run[0]))
+
+// reading a range of blocks with 'r' commands of a few run lengths,
+// showing the data segments each request took, at most one per DMA
+// slab unless the device's segments are shorter. the runs are streamed
+// through a data port of the usual size, and then a page-sized one.
+static void
+bench_runs(void)
+{
+  int dp, dm, ok;
+  uint64 start, t, nreq;
+  char resp[10];
+
+  dm = port_acquire(-1, 0);
+  printf("reading %d blocks in runs, %d byte device blocks\n",
+         BENCH_RBLOCKS, virtio_disk_blocksize());
+
+  for(int size = PORT_BUF_SIZE; size <= PORT_MAX_SIZE; size *= 4){
+    dp = port_acquire_size(-1, 0, size);
+    printf("  %d byte data port\n", port_size(dp));
+    for(int r = 0; r < BENCH_NRUN; r++){
+      int n = bench_run[r];
+      if(n * BSIZE % virtio_disk_blocksize() != 0)
+        continue;
+      virtio_disk_stats(&before);
+      ok = 1;
+      start = r_time();
+      for(int b = 0; b < BENCH_RBLOCKS; b += n){
+        intr_off();
+        pprintf(PORT_DISKCMD, "r%7d%4d%4d%4d", BENCH_WBASE + b, n, dp, dm);
+        virtio_disk_start();
+        while(ports[dm].count < 9){
+          intr_on();
+          intr_off();
+          virtio_disk_poll();
+        }
+        port_read(dm, resp, 9);
+        ok &= resp[1] == 'S';
+        // the blocks follow as the data port is read.
+        for(int i = 0; ok && i < n; i++)
+          for(int k = 0; k < BSIZE; k += port_read(dp, bench_buf + k,
+                                                   BSIZE - k))
+            virtio_disk_start();
+        intr_on();
+      }
+      t = r_time() - start;
+      virtio_disk_stats(&after);
+      nreq = after.requests - before.requests;
+      if(!ok || nreq == 0){
+        printf("  runs of %d: FAILED\n", n);
+        continue;
+      }
+      printf("  runs of %d: %d ticks, %d requests, %d.%d segments each\n",
+             n, (int)t, (int)nreq,
+             (int)((after.segments - before.segments) / nreq),
+             (int)((after.segments - before.segments) * 10 / nreq % 10));
+    }
+    port_close(dp);
+  }
+
+  port_close(dm);
+}
+
+static void
+bench_bio_done(struct bio *b)
+{
+  *(volatile int *) b->arg = 1;
+}
+
+// read one block with a bio and wait for it. returns its status.
+static int
+bench_bio_one(int blockid)
+{
+  struct bio b;
+  volatile int done = 0;
+
+  b.op = DISK_BIO_READ;
+  b.blockid = blockid;
+  b.nblocks = 1;
+  b.data = bench_buf;
+  b.done = bench_bio_done;
+  b.arg = (void *) &done;
+  intr_off();
+  if(virtio_disk_submit(&b) < 0){
+    intr_on();
+    return -1;
+  }
+  while(!done){
+    intr_on();
+    intr_off();
+    virtio_disk_poll();
+  }
+  intr_on();
+  return b.status;
+}
+
+// the same reads as bench_readahead's, one block at a time with
+// the cache off, as 'R' commands and as bios, which skip formatting
+// the command and parsing the response, and the copy through the
+// data port.
+static void
+bench_bio(void)
+{
+  uint64 start, t;
+  int dp, dm, ok;
+
+  dp = port_acquire(-1, 0);
+  dm = port_acquire(-1, 0);
+  printf("'R' commands against bios, %d blocks one at a time\n", BENCH_SEQ);
+
+  for(int m = 0; m < 2; m++){
+    ok = 1;
+    start = r_time();
+    for(int i = 0; i < BENCH_SEQ; i++)
+      ok &= m == 0 ? bench_one('R', i, dp, dm) == 'S' : bench_bio_one(i) == 0;
+    t = r_time() - start;
+    if(!ok){
+      printf("  %s: FAILED\n", m == 0 ? "'R'" : "bio");
+      continue;
+    }
+    printf("  %s: %d ticks per read\n", m == 0 ? "'R'" : "bio",
+           (int)(t / BENCH_SEQ));
+  }
+
+  port_close(dp);
+  port_close(dm);
+}
+
+void
+disk_bench(void)
+{
+  uartflush();
+  bench_alloc();
+  bench_msgfmt();
+  intr_on();
+  // the other benchmarks are of the device, so they go around
+  // the cache.
+  virtio_disk_cache(DISK_CACHE_OFF);
+  bench_qdepth();
+  bench_queues();
+  bench_poll();
+  bench_stats();
+  bench_cache();
+  bench_wcache();
+  bench_readahead();
+  bench_coalesce();
+  bench_zero();
+  bench_runs();
+  bench_bio();
+  virtio_disk_cache(DISK_CACHE_WRITETHROUGH);
+  intr_off();
+  uartflush();
+}
@@ -0,0 +1,12 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Run the disk benchmarks and print the results to the console.
+ * Only built into the boot sequence with BENCH=1.
+ * Parameters: None
+ * Returns: None
+ */
+void disk_bench(void);
+
+#endif // BENCH_H
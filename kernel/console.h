@@ -40,7 +40,9 @@ void uartputc(int c);
 void uartflush(void);
 
 /*
- * Print to the console. Only understands %d, %x, %p, %s.
+ * Print to the console. Only understands %d, %x, %p, %s. Output
+ * that doesn't fit in PORT_CONSOLEOUT waits for the uart to send
+ * what is there, rather than being dropped.
  * Parameters:
  *  - fmt: The format string.
  *  - ...: The values to format according to the format string.
@@ -49,7 +51,9 @@ void uartflush(void);
 void printf(char *fmt, ...);
 
 /*
- * Print to the specified port
+ * Print to the specified port. Output of up to 128 bytes is written
+ * whole, or not at all if the port doesn't have room for it, except
+ * on PORT_CONSOLEOUT, where it is printed as printf would.
  * Parameters:
  * - port: The port number to print to.
  * - fmt: The format string.
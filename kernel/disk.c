@@ -11,6 +11,7 @@
 #include "virtio.h"
 #include "port.h"
 #include "disk.h"
+#include "bcache.h"
 #include "string.h"
 #include "mem.h"
 #include "console.h"
@@ -18,11 +19,100 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk
+#define SLAB_BLOCKS (PGSIZE / BSIZE) // blocks in a DMA slab
+#define SLAB_FULL ((1 << SLAB_BLOCKS) - 1) // a slab with all blocks free
+#define MAXSLAB ((MAXRUN + SLAB_BLOCKS - 1) / SLAB_BLOCKS) // most per run
+
+_Static_assert(SLAB_BLOCKS <= 8, "a slab's free blocks must fit in a uint8");
+
+// per-request state, for use when the completion interrupt
+// arrives. allocated at init, one per descriptor. with a packed
+// ring the indirect table is in that format, and when indirect
+// descriptors are not in use it is where format_req builds the
+// chain before it is copied into the ring.
+struct disk_info
+{
+  // indirect descriptor table, used when the device supports
+  // them. the ring descriptor of the request points here, and
+  // this holds the request's header, data and status chain.
+  struct virtq_desc itable[MAXRUN + 2];
+
+  // disk command header.
+  struct virtio_blk_req op;
+
+  // the one range of a 'z' or 'd' command, which is its data.
+  struct virtio_blk_dwz range;
+
+  int ndesc; // ring descriptors taken, for a packed ring
+  int nseg;  // data descriptors: see buf_nseg, or one for a range
+
+  char mode;
+  uint64 blockid;
+  unsigned int data_port;
+  unsigned int msg_port;
+  int status;
+  int binary;  // did the command come in binary form?
+  int tagged;  // or in ASCII with a tag?
+  uint32 tag;  // the command's tag, for the response
+
+  // or the bio this is for, which has no ports, and whose own data
+  // the blocks are.
+  struct bio *bio;
+
+  // called once the device has finished the request, to answer
+  // whoever it is for and release it: port_done for a command,
+  // bio_done for a bio, or the cache's writeback_done or ahead_done.
+  void (*done)(int id);
+
+  // the blocks of the command, where each goes in its DMA slabs:
+  // for a run, buf[i] is block i % SLAB_BLOCKS of a slab, which
+  // starts at buf[i - i % SLAB_BLOCKS], and a single block is any
+  // block of a slab. 'z' and 'd' have none, and count the blocks of
+  // their range in nrange.
+  int nblocks;
+  char *buf[MAXRUN];
+  uint32 nrange;
+
+  // the slabs the blocks were taken from, as indexes into the
+  // queue's slab[], and which blocks of each one they were.
+  int nslab;
+  uint8 slab[MAXSLAB];
+  uint8 slabmask[MAXSLAB];
+
+  // does buf[0] point into the data port's ring rather than into
+  // a slab?
+  int zerocopy;
+
+  // cached: was the block cache on at submission? flush: is this
+  // the write-back of a dirty cached block, with no one to answer?
+  // ahead: or a read-ahead into the cache? gen: for reads,
+  // bcache_gen() at submission.
+  int cached;
+  int flush;
+  int ahead;
+  uint32 gen;
+
+  // for 'r' and 'w' commands, which stream their data through
+  // the data port: bytes moved so far, and the next request on
+  // the disk.stream list.
+  int nbytes;
+  int next;
+
+  uint64 queued; // r_time() when the command was taken
+  uint64 start;  // r_time() at submission
+} __attribute__((aligned(16)));
+
+#define INFO_PER_PAGE (PGSIZE / sizeof(struct disk_info))
+
+// one virtqueue. with VIRTIO_BLK_F_MQ there is one per hart, so
+// that harts can submit without sharing a ring.
+struct vq
 {
+  int qid; // for VIRTIO_MMIO_QUEUE_SEL and _NOTIFY
+
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
-  // disk operations. there are NUM descriptors.
+  // disk operations. there are num descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
   struct virtq_desc *desc;
@@ -30,94 +120,400 @@ static struct disk
   // a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // num elements.
   struct virtq_avail *avail;
 
   // a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // there are num used ring entries.
   struct virtq_used *used;
 
   // our own book-keeping.
+  int num;         // queue size, picked at init; at most NUM.
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  int nfree;       // how many descriptors are free?
+  int free_head;   // first free descriptor; the rest follow desc[].next
+  uint16 used_idx; // we've looked this far in used[2..num].
 
-  // track info about in-flight operations,
-  // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
-  struct
-  {
-    char mode;
-    unsigned int blockid;
-    unsigned int data_port;
-    unsigned int msg_port;
-    int status;
-  } info[NUM];
+  // with event_idx, the avail ring ends with used_event, the
+  // used ring index at which the device should next interrupt,
+  // and the used ring with avail_event, the avail ring index at
+  // which the device wants to be notified. both follow ring[num].
+  volatile uint16 *used_event;
+  volatile uint16 *avail_event;
 
-  // disk command headers.
-  // one-for-one with descriptors, for convenience.
-  struct virtio_blk_req ops[NUM];
+  // with VIRTIO_F_RING_PACKED, desc is instead pdesc, a ring in
+  // which each chain takes the next descriptors in order and the
+  // device marks them used in place. avail and used are then the
+  // driver's and the device's event suppression areas. requests
+  // are named by a buffer id rather than a descriptor index, and
+  // nfree counts ring descriptors not taken by a request.
+  struct virtq_pdesc *pdesc;
+  volatile struct virtq_event *driver_event;
+  volatile struct virtq_event *device_event;
+  uint16 next_avail; // where the next chain goes
+  int avail_wrap;    // wrap counter for next_avail
+  uint16 next_used;  // where the next used chain will be
+  int used_wrap;     // wrap counter for next_used
+  uint16 ids[NUM];   // stack of free buffer ids
+  int nids;
+
+  // track info about in-flight operations.
+  // indexed by first descriptor index of chain.
+  struct disk_info *info[NUM];
 
   // We need a set of disk buffers for pulling information
   // in and out of ports. The reason for this is that port data
   // may not necessarily align with the beginning of their internal
-  // array. We will use these buffers in alignment with the info
-  // array. So the id will index this buffer as well.
-  char buffer[NUM][BSIZE];
+  // array. Single-block commands skip them when the block can sit
+  // in one piece in the port's ring; see zerocopy_req. They come
+  // in slabs, each a page from vm_page_alloc holding SLAB_BLOCKS
+  // blocks. a run takes whole slabs, and a single block takes one
+  // block of a slab, so that short requests don't hold a page each.
+  // nslabs are allocated, as init_queue works out, and slabfree[i]
+  // has a bit set for each free block of slab[i]. nwhole slabs are
+  // wholly free, and part is a slab with some blocks taken and some
+  // free, if there is one, which single blocks come from first.
+  char *slab[NUM];
+  uint8 slabfree[NUM];
+  int nslabs;
+  int nwhole;
+  int part;
+
+  // requests placed in the avail ring after avail->idx, which
+  // the device doesn't know about until publish(). with a packed
+  // ring, descriptors made available since the last publish().
+  int npending;
+};
+
+// what read-ahead knows of the reads through one data port.
+struct ra
+{
+  uint64 next;  // block after the port's last read
+  int run;      // reads in a row that followed on from the one before
+  uint64 ahead; // blocks up to here have been read ahead
+  int window;   // blocks to keep read ahead of the reader
+  int tries;    // reads of read-ahead blocks since the window changed
+  int hits;     // and how many of them the cache had
+  int pending;  // read-ahead requests in flight
+};
+
+static struct disk
+{
+  struct vq q[NQUEUE];
+  int nqueue;      // queues set up at init; at most NQUEUE.
+  int spread;      // see virtio_disk_spread
+  int next_queue;
+
+  int indirect;    // was VIRTIO_RING_F_INDIRECT_DESC negotiated?
+  int event_idx;   // was VIRTIO_RING_F_EVENT_IDX negotiated?
+  int packed;      // was VIRTIO_F_RING_PACKED negotiated?
+  int flush;       // was VIRTIO_BLK_F_FLUSH negotiated?
+  int wce;         // and VIRTIO_BLK_F_CONFIG_WCE?
+
+  // the disk's size in blocks, and how many blocks make up one of
+  // the device's own, which commands have to line up with.
+  uint64 nblocks;
+  int lbs;
+
+  // the most blocks in one 'r' or 'w', which is less than MAXRUN
+  // if the device takes fewer data segments (seg_max), and the
+  // most blocks in one segment, which is less than SLAB_BLOCKS if
+  // the device takes shorter ones (size_max).
+  int maxrun;
+  int seg_blocks;
+
+  // were VIRTIO_BLK_F_WRITE_ZEROES and _DISCARD negotiated, the
+  // most blocks one 'z' or 'd' may cover, 0 if the device sets no
+  // limit, and whether zeroed blocks may be unmapped.
+  int zeroes;
+  int discard;
+  uint32 max_zeroes;
+  uint32 max_discard;
+  int unmap;
+
+  // requests whose data is being streamed through their data
+  // port, linked through info->next. -1 if there are none.
+  int stream;
+
+  // bios waiting to be started, in order, and whether a bio's done
+  // is being called, when a bio it submits can't start the disk.
+  struct bio *bios;
+  struct bio *bios_tail;
+  int completing;
+
+  // data ports that are tied up by a streaming command.
+  char busy[NPORT];
+
+  int cache; // one of DISK_CACHE_*
+
+  // write requests in flight, the 'F' request in flight or -1, and
+  // whether an 'F' is waiting for the writes before it to finish.
+  int nwrites;
+  int barrier;
+  int draining;
+
+  // read-ahead state per data port, and the largest window.
+  struct ra ra[NPORT];
+  int ra_max;
+
+  // completions. mode is one of DISK_MODE_*, and polling says
+  // whether device interrupts are currently turned off. lat is a
+  // moving average of recent request latencies, in r_time() ticks.
+  int mode;
+  int polling;
+  int ninflight;
+  uint64 lat;
+
+  struct disk_stats stats;
 } disk;
 
+// requests are named by their queue and their index in it (the
+// head descriptor, or the buffer id of a packed ring), so that
+// one int says where to find them.
+#define REQ(q, i) ((q)->qid * NUM + (i))
+#define REQ_QUEUE(id) (&disk.q[(id) / NUM])
+#define REQ_INFO(id) (disk.q[(id) / NUM].info[(id) % NUM])
+
+// in DISK_MODE_ADAPTIVE, poll while the average latency is below
+// POLL_LAT ticks and no more than POLL_QMAX requests are in flight.
+// going back to interrupts takes twice the latency, so that the
+// mode doesn't flap. with a deeper queue, one interrupt reaps
+// several requests and polling would mostly spin.
+#define POLL_LAT  500 // 50us
+#define POLL_QMAX 4
+
+// read-ahead windows, in blocks, start at RA_MIN and grow to at
+// most disk.ra_max (see virtio_disk_readahead).
+#define RA_MIN 2
+
+// in write-back mode, dirty blocks are written back once they
+// have waited this long, even while the cache has room.
+#define WB_EXPIRE (10 * 1000 * 1000) // 1s
+
+// failed write-backs after which virtio_disk_cache gives up on the
+// dirty blocks it is waiting for.
+#define WB_TRIES 3
+
+// the longest disk message, in either form.
+#define MSGMAX (DISK_TAG_LEN + 20)
+
 /*
  * Disk message to command the driver.
  */
 struct disk_msg
 {
   char mode;
-  unsigned int blockid;
+  uint64 blockid;
+  unsigned int nblocks;
   unsigned int data_port;
   unsigned int msg_port;
+  int len;
+  int binary;
+  int tagged;
+  uint32 tag;
 };
 
+// copy the first n bytes of port p into buf without consuming them.
+static void
+peek_bytes(int p, char *buf, int n)
+{
+  struct port_iov span[2];
+  int first;
+
+  port_peek(p, span);
+  first = n < span[0].len ? n : span[0].len;
+  memmove(buf, span[0].buf, first);
+  memmove(buf + first, span[1].buf, n - first);
+}
+
+// parse the decimal field of width n at s.
+static int
+msg_field(char *s, int n)
+{
+  char field[8];
+
+  // the fields are space padded, so each one is copied out and
+  // terminated before handing it to atoi.
+  safestrcpy(field, s, n + 1);
+  return atoi(field);
+}
+
+// does a command of this mode change what is on the disk?
+static int
+is_write(char mode)
+{
+  return mode == 'W' || mode == 'w' || mode == 'z' || mode == 'd';
+}
+
+// is it a range command, which has a block count but no data?
+static int
+is_range(char mode)
+{
+  return mode == 'z' || mode == 'd';
+}
+
+// are the n blocks from blockid on the disk, and do they start and
+// end with one of the device's own blocks?
+static int
+on_disk(uint64 blockid, uint64 n)
+{
+  return n >= 1 && blockid < disk.nblocks && n <= disk.nblocks - blockid &&
+         blockid % disk.lbs == 0 && n % disk.lbs == 0;
+}
+
+// slabs taken by a request of nblocks blocks.
+static int
+req_nslab(int nblocks)
+{
+  return (nblocks + SLAB_BLOCKS - 1) / SLAB_BLOCKS;
+}
+
+// data descriptors needed by a request of nblocks blocks: one for
+// each slab, or more if the device's segments are shorter.
+static int
+req_nseg(int nblocks)
+{
+  int nseg = 0;
+
+  for(int i = 0; i < nblocks; i += SLAB_BLOCKS){
+    int n = nblocks - i < SLAB_BLOCKS ? nblocks - i : SLAB_BLOCKS;
+    nseg += (n + disk.seg_blocks - 1) / disk.seg_blocks;
+  }
+  return nseg;
+}
+
+// does block i of buf start a new data segment, rather than go on
+// from block i - 1 in memory, in a segment of len blocks so far?
+static int
+seg_starts(char **buf, int i, int len)
+{
+  return i == 0 || buf[i] != buf[i-1] + BSIZE || len == disk.seg_blocks;
+}
+
+// data descriptors the n blocks at buf take, as format_req lays
+// them out. for blocks in slabs or a bio's data, this is at most
+// req_nseg(n).
+static int
+buf_nseg(char **buf, int n)
+{
+  int nseg = 0, len = 0;
+
+  for(int i = 0; i < n; i++){
+    if(seg_starts(buf, i, len)){
+      nseg++;
+      len = 0;
+    }
+    len++;
+  }
+  return nseg;
+}
+
 /*
- * Read the next disk message from the PORT_DISKCMD port.
- * The message is formatted as follows:
- *   BLOCKID  - 7 Characters
+ * Look at the next disk message in the PORT_DISKCMD port, without
+ * removing it. The message is formatted as follows:
+ *   TAG       - '#' and 7 Characters (optional)
+ *   MODE      - 1 Character
+ *   BLOCKID   - 7 Characters
+ *   COUNT     - 4 Characters (only for the 'r', 'w', 'z' and 'd' modes)
  *   Data Port - 4 Characters
  *   Msg Port  - 4 Characters
- * Returns: The message (if there is one), otherwise a message with mode 'N'
+ * or is a struct disk_bmsg if it starts with DISK_BMSG_MAGIC.
+ * Returns: The message, with len the number of bytes it takes up, or
+ *          a message with len 0 if there isn't a whole one yet.
  */
 static struct disk_msg
 get_disk_msg()
 {
   struct disk_msg msg;
+  struct disk_bmsg bmsg;
+  char buf[MSGMAX];
+  char *p;
+  int off, len;
 
-  // This function should read a message from the disk port. If there
-  // is no message, it should return a message with 'N' mode.
-  // To do this, you must do the following:
-  // 1. Check to see if there are at least 16 characters in the port.
-  //    If there are not at least 16 characters, return a message with
-  //    mode 'N'.
-  // 2. Read the message from the port, and parse it into the message struct.
-  // HINT: The atoi function in string.h may be useful for converting
-  //       strings to integers.
-  // YOUR CODE HERE
-  if(ports[PORT_DISKCMD].count < 16){
-    msg.mode = 'N';
-  }else{
-    msg.mode = ports[PORT_DISKCMD].buffer[0];
-    for(int i = 1; i < 8; i++){
-      msg.blockid += atoi(ports[PORT_DISKCMD].buffer[i]);
-    }
-    for(int i = 8; i < 12; i++){
-      msg.data_port += atoi(ports[PORT_DISKCMD].buffer[i]);
-    }
-    for(int i = 12; i < ports[PORT_DISKCMD].count; i++){
-      msg.msg_port += atoi(ports[PORT_DISKCMD].buffer[i]);
-    }
+  msg.len = 0;
+  if(ports[PORT_DISKCMD].count < 1)
+    return msg;
+  peek_bytes(PORT_DISKCMD, buf, 1);
+
+  if((uchar)buf[0] == DISK_BMSG_MAGIC){
+    // the binary form needs no parsing.
+    if(ports[PORT_DISKCMD].count < sizeof(bmsg))
+      return msg;
+    peek_bytes(PORT_DISKCMD, (char *) &bmsg, sizeof(bmsg));
+    msg.len = sizeof(bmsg);
+    msg.mode = bmsg.mode;
+    msg.blockid = bmsg.blockid;
+    // as in ASCII, only the run and range commands have a length.
+    msg.nblocks = 1;
+    if(bmsg.mode == 'r' || bmsg.mode == 'w' || is_range(bmsg.mode))
+      msg.nblocks = bmsg.nblocks;
+    msg.data_port = bmsg.data_port;
+    msg.msg_port = bmsg.msg_port;
+    msg.binary = 1;
+    msg.tagged = 0;
+    msg.tag = bmsg.tag;
+    return msg;
+  }
+
+  // a tag comes before the mode.
+  off = 0;
+  if(buf[0] == '#'){
+    off = DISK_TAG_LEN;
+    if(ports[PORT_DISKCMD].count < off + 1)
+      return msg;
+    peek_bytes(PORT_DISKCMD, buf, off + 1);
+  }
+
+  len = off + ((buf[off] == 'r' || buf[off] == 'w' ||
+                is_range(buf[off])) ? 20 : 16);
+  if(ports[PORT_DISKCMD].count < len)
+    return msg;
+  peek_bytes(PORT_DISKCMD, buf, len);
+  msg.len = len;
+
+  msg.tagged = off != 0;
+  msg.tag = off ? msg_field(buf+1, DISK_TAG_LEN-1) : 0;
+  msg.mode = buf[off];
+  msg.blockid = msg_field(buf+off+1, 7);
+  p = buf + off + 8;
+  msg.nblocks = 1;
+  if(len == off + 20){
+    msg.nblocks = msg_field(p, 4);
+    p += 4;
   }
+  msg.data_port = msg_field(p, 4);
+  msg.msg_port = msg_field(p+4, 4);
+  msg.binary = 0;
 
   return msg;
 }
 
+// write a response to port in the same form as the command.
+static void
+send_response(int port, int binary, int tagged, char mode, char status,
+              uint64 blockid, uint32 tag)
+{
+  struct disk_bresp resp;
+
+  if(status == 'F')
+    disk.stats.failures += 1;
+
+  if(binary){
+    resp.magic = DISK_BMSG_MAGIC;
+    resp.mode = mode;
+    resp.status = status;
+    resp.reserved = 0;
+    resp.tag = tag;
+    resp.blockid = blockid;
+    port_write(port, (char *) &resp, sizeof(resp));
+  } else if(tagged){
+    pprintf(port, "#%7d%c%c%7d", (int) tag, mode, status, (int) blockid);
+  } else {
+    pprintf(port, "%c%c%7d", mode, status, (int) blockid);
+  }
+}
+
 /* Write a response to the disk command from the driver's
  * info array.
  * Parameters:
@@ -127,34 +523,112 @@ get_disk_msg()
 static void
 write_disk_response(char status, int id)
 {
-  // This function should write a response to the disk command.
-  // The response should be formatted as follows:
+  // The response is formatted as follows:
+  //   TAG   - '#' and 7 Characters, if the command had one
   //   MODE  - 1 Character
   //   STATUS - 1 Character
   //   BLOCKID - 7 Characters
-  // The response should be written to the message port specified
-  // in disk.info[id].
-  // HINT: The pprintf function specified in console.h will come in
-  //       handy here!
-  // YOUR CODE HERE
-  /*
-  disk.info[id].mode = ports[PORT_DISKCMD].buffer[0];
-  disk.info[id].status = status;
-  for(int i = 2; i < 9; i++){
-    disk.info[id].blockid += ports[PORT_DISKCMD].buffer[i];
-  }*/
- 
-  /*
-  ports[PORT_DISKCMD].buffer[0] = disk.info[id].mode;
-  ports[PORT_DISKCMD].buffer[1] = status;
-  for(int i = 2; i < ports[PORT_DISKCMD].count; i++){
-    disk.info[id].blockid = ports[PORT_DISKCMD].buffer[i];
-  }*/
-  disk.info[id].mode = disk.buffer[id][0];
-  disk.info[id].status = status;
-  for(int i = 2; i < 9; i++){
-    disk.info[id].blockid += disk.buffer[id][i];
+  // or is a struct disk_bresp for binary commands.
+  struct disk_info *info = REQ_INFO(id);
+
+  if(status == 'S' && (info->mode == 'R' || info->mode == 'r'))
+    disk.stats.bytes_read += info->nblocks * BSIZE;
+  else if(status == 'S')
+    disk.stats.bytes_written += info->nblocks * BSIZE;
+  send_response(info->msg_port, info->binary, info->tagged, info->mode,
+                status, info->blockid, info->tag);
+}
+
+// set up virtqueue qid. features have been negotiated.
+static void
+init_queue(struct vq *q, int qid)
+{
+  q->qid = qid;
+  *R(VIRTIO_MMIO_QUEUE_SEL) = qid;
+
+  // ensure the queue is not in use.
+  if(*R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // check maximum queue size, and use the largest power of
+  // two that both the device and NUM allow.
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk queue missing");
+  q->num = NUM;
+  while(q->num > max)
+    q->num /= 2;
+  if(q->num < 4)
+    panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  q->desc = vm_page_alloc();
+  q->avail = vm_page_alloc();
+  q->used = vm_page_alloc();
+  if(!q->desc || !q->avail || !q->used)
+    panic("virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+  q->used_event = &q->avail->ring[q->num];
+  q->avail_event = (uint16 *) &q->used->ring[q->num];
+
+  // a packed ring uses the same three pages. its descriptors start
+  // out neither available nor used, since both flags are zero.
+  q->pdesc = (struct virtq_pdesc *) q->desc;
+  q->driver_event = (struct virtq_event *) q->avail;
+  q->device_event = (struct virtq_event *) q->used;
+  q->avail_wrap = q->used_wrap = 1;
+  if(disk.packed && disk.event_idx){
+    q->driver_event->off_wrap = 1 << 15;
+    q->driver_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+  }
+
+  // allocate the per-request info and buffers, packed into pages.
+  char *page = 0;
+  for(int i = 0; i < q->num; i++){
+    if(i % INFO_PER_PAGE == 0 && (page = vm_page_alloc()) == 0)
+      panic("virtio disk kalloc");
+    q->info[i] = (struct disk_info *) page + i % INFO_PER_PAGE;
+  }
+  // a block of buffer for every descriptor, so that every request
+  // can have one, but always enough slabs for the longest run.
+  q->nslabs = q->num / SLAB_BLOCKS;
+  if(q->nslabs < req_nslab(disk.maxrun))
+    q->nslabs = req_nslab(disk.maxrun);
+  for(int i = 0; i < q->nslabs; i++){
+    if((q->slab[i] = vm_page_alloc()) == 0)
+      panic("virtio disk kalloc");
+    q->slabfree[i] = SLAB_FULL;
+  }
+  q->nwhole = q->nslabs;
+  q->part = -1;
+
+  // set queue size.
+  *R(VIRTIO_MMIO_QUEUE_NUM) = q->num;
+
+  // write physical addresses.
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // queue is ready.
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all num descriptors start out unused, in order on the list.
+  // a packed ring has no list, but the buffer ids are on a stack.
+  for(int i = 0; i < q->num; i++){
+    q->free[i] = 1;
+    if(disk.packed)
+      q->ids[q->nids++] = q->num - 1 - i;
+    else
+      q->desc[i].next = i + 1;
   }
+  q->free_head = 0;
+  q->nfree = q->num;
 }
 
 /*
@@ -198,15 +672,29 @@ void virtio_disk_init(void)
   *R(VIRTIO_MMIO_STATUS) = status;
 
   // negotiate features
+  *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
   uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
-  features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+
+  // the device's write cache is only safe to turn on if it can
+  // be flushed.
+  if(!((features >> VIRTIO_BLK_F_FLUSH) & 1))
+    features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
+
+  // of the high feature bits, take only the packed ring, which
+  // needs VERSION_1 as well. otherwise leave them all off.
+  uint64 packed = (1L << VIRTIO_F_VERSION_1) | (1L << VIRTIO_F_RING_PACKED);
+  *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+  if((((uint64) *R(VIRTIO_MMIO_DEVICE_FEATURES) << 32) & packed) == packed)
+    features |= packed;
+
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features >> 32;
+  disk.stats.features = features;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -217,47 +705,115 @@ void virtio_disk_init(void)
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
+  // with indirect descriptors each request takes one ring slot
+  // instead of three.
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
 
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
+  // with event indexes the device can skip interrupts and we
+  // can skip notifies that the other side has no use for.
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
+  disk.packed = (features >> VIRTIO_F_RING_PACKED) & 1;
 
-  // allocate and zero queue memory.
-  disk.desc = vm_page_alloc();
-  disk.avail = vm_page_alloc();
-  disk.used = vm_page_alloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
+  // the disk's geometry. a config field wider than 32 bits is read
+  // in halves, so it is read again if the device changed it between
+  // them.
+  uint32 gen;
+  uint64 capacity;
+  do {
+    gen = *R(VIRTIO_MMIO_CONFIG_GENERATION);
+    capacity = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY) |
+      (uint64) *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32;
+  } while(gen != *R(VIRTIO_MMIO_CONFIG_GENERATION));
+  disk.nblocks = capacity / (BSIZE / 512);
 
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  uint32 size_max = PGSIZE;
+  if((features >> VIRTIO_BLK_F_SIZE_MAX) & 1)
+    size_max = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_SIZE_MAX);
+  if(size_max < BSIZE)
+    panic("virtio disk size_max");
+  disk.seg_blocks = size_max < PGSIZE ? size_max / BSIZE : SLAB_BLOCKS;
 
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
+  disk.maxrun = MAXRUN;
+  if((features >> VIRTIO_BLK_F_SEG_MAX) & 1){
+    uint32 seg_max = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_SEG_MAX);
+    if(seg_max < 1)
+      panic("virtio disk seg_max");
+    while(req_nseg(disk.maxrun) > seg_max)
+      disk.maxrun--;
+  }
 
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+  // a device block may take up several pages, but has to fit in one
+  // command. with blocks too big for that, or of a size that makes
+  // no sense, the disk is left looking empty, so every command that
+  // would reach it fails.
+  uint32 blk_size = 512;
+  if((features >> VIRTIO_BLK_F_BLK_SIZE) & 1)
+    blk_size = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_BLK_SIZE);
+  disk.lbs = blk_size > BSIZE ? blk_size / BSIZE : 1;
+  if(blk_size < 512 || (blk_size & (blk_size - 1)) ||
+     disk.lbs > disk.maxrun){
+    printf("virtio disk: can't use %d byte blocks\n", (int) blk_size);
+    disk.lbs = 1;
+    disk.nblocks = 0;
+  }
+
+  // with a flush command the device may cache writes, and with
+  // CONFIG_WCE we get to say that it should.
+  disk.flush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
+  disk.wce = (features >> VIRTIO_BLK_F_CONFIG_WCE) & 1;
+  if(disk.wce)
+    *(volatile uint8 *)
+      R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_WRITEBACK) = 1;
+
+  // ranges to zero or discard are sent in a single segment, of
+  // at most as many sectors as the device takes in one.
+  disk.zeroes = (features >> VIRTIO_BLK_F_WRITE_ZEROES) & 1;
+  disk.discard = (features >> VIRTIO_BLK_F_DISCARD) & 1;
+  // the limits are in sectors, and 0 is no limit. a device that
+  // can't take even one block at a time can't be used for either.
+  if(disk.zeroes){
+    uint32 max = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_MAX_ZEROES);
+    disk.max_zeroes = max / (BSIZE / 512);
+    if(max != 0 && disk.max_zeroes == 0)
+      disk.zeroes = 0;
+    disk.unmap = *(volatile uint8 *)
+      R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_ZEROES_UNMAP);
+  }
+  if(disk.discard){
+    uint32 max = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_MAX_DISCARD);
+    disk.max_discard = max / (BSIZE / 512);
+    if(max != 0 && disk.max_discard == 0)
+      disk.discard = 0;
+  }
+
+  // with VIRTIO_BLK_F_MQ the device says how many queues it has.
+  disk.nqueue = 1;
+  if((features >> VIRTIO_BLK_F_MQ) & 1)
+    disk.nqueue = *(volatile uint16 *)
+      R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+  if(disk.nqueue > NQUEUE)
+    disk.nqueue = NQUEUE;
+  disk.stats.queues = disk.nqueue;
+  for(int i = 0; i < disk.nqueue; i++)
+    init_queue(&disk.q[i], i);
+
+  disk.stream = -1;
+  disk.barrier = -1;
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // queries for the stats come in on a port of their own.
+  if(port_acquire(PORT_DISKSTAT, 0) != PORT_DISKSTAT)
+    panic("virtio disk stat port");
+
+  bcache_init();
+  disk.cache = DISK_CACHE_WRITETHROUGH;
+  if(disk.lbs > 1)
+    disk.cache = DISK_CACHE_OFF;
+  virtio_disk_readahead(DISK_READAHEAD);
+
+  // start out with interrupts, until there are latencies to go by.
+  disk.mode = DISK_MODE_ADAPTIVE;
+  disk.lat = 2 * POLL_LAT;
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -266,214 +822,1612 @@ void virtio_disk_init(void)
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
-// find a free descriptor, mark it non-free, return its index.
+// take a chain of n descriptors off the free list, linked
+// with VRING_DESC_F_NEXT, and return the index of its head. the
+// free list is threaded through desc[].next, so the chain is
+// already linked and only needs its flags set.
 static int
-alloc_desc()
+alloc_chain(struct vq *q, int n)
 {
-  for (int i = 0; i < NUM; i++)
-  {
-    if (disk.free[i])
-    {
-      disk.free[i] = 0;
-      return i;
-    }
+  int head = q->free_head;
+  int i = head;
+
+  if(n < 1 || q->nfree < n)
+    return -1;
+  if(disk.packed){
+    // only room in the ring is taken here. submit_req puts the
+    // chain in the next n descriptors.
+    head = q->ids[--q->nids];
+    q->info[head]->ndesc = n;
+    q->nfree -= n;
+    return head;
+  }
+  for(int k = 1; ; k++){
+    if(!q->free[i])
+      panic("alloc_chain");
+    q->free[i] = 0;
+    if(k == n)
+      break;
+    q->desc[i].flags = VRING_DESC_F_NEXT;
+    i = q->desc[i].next;
   }
-  return -1;
+  q->free_head = q->desc[i].next;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->nfree -= n;
+  return head;
 }
 
-// mark a descriptor as free.
+// put a chain of descriptors back on the free list.
 static void
-free_desc(int i)
+free_chain(struct vq *q, int i)
 {
-  if (i >= NUM)
-    panic("free_desc 1");
-  if (disk.free[i])
-    panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-}
+  int head = i;
+
+  if(disk.packed){
+    q->nfree += q->info[i]->ndesc;
+    q->ids[q->nids++] = i;
+    return;
+  }
 
-// free a chain of descriptors.
-static void
-free_chain(int i)
-{
   while (1)
   {
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
-    if (flag & VRING_DESC_F_NEXT)
-      i = nxt;
-    else
+    if (i >= q->num)
+      panic("free_chain 1");
+    if (q->free[i])
+      panic("free_chain 2");
+    q->free[i] = 1;
+    q->nfree++;
+    if (!(q->desc[i].flags & VRING_DESC_F_NEXT))
       break;
+    i = q->desc[i].next;
   }
+  q->desc[i].next = q->free_head;
+  q->free_head = head;
 }
 
-// free an array of up to 3 descriptors
-static void
-free3_desc(int *idx)
+// ring descriptors needed by a request with nseg data descriptors.
+static int
+req_ndesc(int nseg)
 {
-  for (int i = 0; i < 3; i++)
-  {
-    if (idx[i] < 0)
-      continue;
-    free_desc(idx[i]);
-  }
+  // with indirect descriptors the whole chain is in the request's
+  // table, otherwise it is a header, the data, and a status.
+  return disk.indirect ? 1 : nseg + 2;
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// choose the slab blocks for a request of nblocks blocks, without
+// taking them yet: whole slabs for a run, and for a single block a
+// free one of q->part or another slab already split, or else of a
+// whole slab. fills in buf, and the slabs and blocks of each in
+// slab and mask. returns the number of slabs, or -1 if there are
+// not enough free.
 static int
-alloc3_desc(int *idx)
+find_slabs(struct vq *q, int nblocks, char **buf, uint8 *slab, uint8 *mask)
 {
-  for (int i = 0; i < 3; i++)
-  {
-    idx[i] = alloc_desc();
-    if (idx[i] < 0)
-    {
-      free3_desc(idx);
+  int i = q->part, b, n = 0;
+
+  if(nblocks > 1){
+    if(q->nwhole < req_nslab(nblocks))
       return -1;
+    for(i = 0; n < req_nslab(nblocks); i++){
+      if(q->slabfree[i] != SLAB_FULL)
+        continue;
+      slab[n] = i;
+      mask[n++] = SLAB_FULL;
     }
+    for(b = 0; b < nblocks; b++)
+      buf[b] = q->slab[slab[b / SLAB_BLOCKS]] + (b % SLAB_BLOCKS) * BSIZE;
+    return n;
   }
-  return 0;
+
+  if(i < 0 || q->slabfree[i] == 0 || q->slabfree[i] == SLAB_FULL){
+    for(i = 0; i < q->nslabs; i++)
+      if(q->slabfree[i] != 0 && q->slabfree[i] != SLAB_FULL)
+        break;
+    if(i == q->nslabs){
+      if(q->nwhole == 0)
+        return -1;
+      for(i = 0; q->slabfree[i] != SLAB_FULL; i++)
+        ;
+    }
+  }
+  for(b = 0; !((q->slabfree[i] >> b) & 1); b++)
+    ;
+  slab[0] = i;
+  mask[0] = 1 << b;
+  buf[0] = q->slab[i] + b * BSIZE;
+  return 1;
 }
 
-// start processing disk messages
-void virtio_disk_start()
+// take the slab blocks find_slabs chose for a request.
+static void
+take_slabs(struct vq *q, struct disk_info *info)
 {
-  // This function should start processing disk message if there is a message
-  // and if the disk has available descriptors. To do this, you must do the
-  // following:
-  //   1. Check to see if there is a disk message waiting for us. You will
-  //      want to do this by checking the PORT_DISKCMD port. Messages are
-  //      16 characters long. If there is no pending message, return.
-  //   2. Attempt to allocate three descriptors. If you cannot allocate
-  //      three descriptors, return.
-  //   3. Extract the disk message from the PORT_DISKCMD port.
-  //   4. Verify that the message is valid. A valid message has a mode
-  //      of 'W' or 'R' and the data port has the correct number of bytes
-  //      (BSIZE) for a write operation or is empty for a read operation.
-  //      If the message is invalid, write a failure response to the message
-  //      port, free the descriptors, and return
-  //   5. Calculate the sector from the disk message
-  //   6. Format the three descriptors. Use xv6 as a reference for how to do
-  //      this. There are a few things to keep in mind:
-  //        - We are using the buffers defined in the disk structure for our
-  //          disk memory interactions. The index of the buffer you should use
-  //          is the first index in the chain of descriptors.
-  //        - The info[idx[0]] struct should be filled out with the mode,
-  //          blockid, data_port, and msg_port from the disk message.
-  //        - Since we are running a single-core kernel, we will not have
-  //          synchronization or spin locks.
-  //   7. Tell the device the first index in our chain of descriptors, and
-  //      tell the device another avail ring entry is available.
-  // YOUR CODE HERE
-  
-  if(ports[PORT_DISKCMD].count < 16)//Checks to see if there is a disk msg
-    return;
+  for(int k = 0; k < info->nslab; k++){
+    int i = info->slab[k];
+    if(q->slabfree[i] == SLAB_FULL)
+      q->nwhole--;
+    q->slabfree[i] &= ~info->slabmask[k];
+    if(q->slabfree[i] != 0)
+      q->part = i;
+  }
+}
 
-  //allocates three descriptors  
-  int idx[3];
-  if(alloc3_desc(idx) == -1)
-    return;
-  
-  //gets disk msg
-  struct disk_msg msg = get_disk_msg();
+// give back a request's slab blocks.
+static void
+put_slabs(struct vq *q, struct disk_info *info)
+{
+  for(int k = 0; k < info->nslab; k++){
+    int i = info->slab[k];
+    q->slabfree[i] |= info->slabmask[k];
+    if(q->slabfree[i] == SLAB_FULL)
+      q->nwhole++;
+    else
+      q->part = i;
+  }
+  info->nslab = 0;
+}
 
-  //Verifes the validity of the message
-  if(msg.mode == 'N'){
-    disk.info[idx[0]].msg_port = "fail";//Probably meant to use a VIRTIO_MMIO..., but can't figure out what it is
-    free3_desc(idx);
-    return;
+// allocate the descriptors and buffers for a request of nblocks
+// blocks, or if nblocks is 0, for one with nrange ranges as its
+// data ('z' and 'd', or none for 'F'). the blocks of bio b are in
+// its data rather than in slabs. returns the index of the head
+// descriptor, which also indexes the request's info, or -1 if the
+// ring or the buffers are too full right now.
+static int
+alloc_req(struct vq *q, int nblocks, int nrange, struct bio *b)
+{
+  struct disk_info *info;
+  char *buf[MAXRUN];
+  uint8 slab[MAXSLAB], mask[MAXSLAB];
+  int nslab = 0, nseg, n, id;
+
+  // the blocks are chosen first, so that their segments can be
+  // counted before anything is taken.
+  if(b){
+    for(int i = 0; i < nblocks; i++)
+      buf[i] = b->data + i * BSIZE;
+  } else if(nblocks && (nslab = find_slabs(q, nblocks, buf, slab, mask)) < 0){
+    return -1;
   }
+  nseg = nblocks ? buf_nseg(buf, nblocks) : nrange;
+  n = req_ndesc(nseg);
+  if(q->nfree < n)
+    return -1;
 
-  int sector = msg.blockid * (BSIZE / 512);//Calculates sector
+  // the chain comes linked, so that free_chain can release it
+  // whether or not it is ever submitted.
+  id = REQ(q, alloc_chain(q, n));
+  info = REQ_INFO(id);
 
-  disk.info[idx[0]].blockid = msg.blockid;
-  disk.info[idx[0]].data_port = msg.data_port;
-  disk.info[idx[0]].msg_port = msg.msg_port;
-  disk.info[idx[0]].mode = msg.mode;
-  
-  //Disk formatting
-  struct virtio_blk_req *buf = &disk.ops[idx[0]];
-  if(msg.mode == 'W')
-    buf->type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf->type = VIRTIO_BLK_T_IN; // read the disk
-  buf->reserved = 0;
-  buf->sector = sector;
+  info->nblocks = nblocks;
+  info->nseg = nseg;
+  info->nrange = 0;
+  info->zerocopy = 0;
+  info->flush = 0;
+  info->ahead = 0;
+  info->queued = r_time();
+  info->bio = b;
+  for(int i = 0; i < nblocks; i++)
+    info->buf[i] = buf[i];
+  info->nslab = nslab;
+  for(int k = 0; k < nslab; k++){
+    info->slab[k] = slab[k];
+    info->slabmask[k] = mask[k];
+  }
+  take_slabs(q, info);
+  return id;
+}
 
-  disk.desc[idx[0]].addr = (uint64) buf;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+// release a request's descriptors and buffers.
+static void
+free_req(int id)
+{
+  struct vq *q = REQ_QUEUE(id);
+  struct disk_info *info = REQ_INFO(id);
 
-  disk.desc[idx[1]].addr = (uint64) disk.info[idx[1]].data_port;
-  disk.desc[idx[1]].len = BSIZE;
-  if(msg.mode == 'W')
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  put_slabs(q, info);
+  info->nblocks = 0;
+  free_chain(q, id % NUM);
+}
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+// try to have the device move an 'R' or 'W' block straight to or
+// from its data port's ring, rather than through a DMA buffer. it
+// has to be a single block, since buf[0] is then the only one not
+// in a slab, and a write's block must not wrap around the end of
+// the ring. the ring has to be the port's own buffer: a bigger one
+// is a page that is freed when the port is closed, which could be
+// while the device still has the block. a read's port is empty, so
+// it can be rewound to deliver the block at the start. the port is
+// busy until the request completes, and its slab block is given
+// back. returns 1 if it worked.
+static int
+zerocopy_req(int id)
+{
+  struct vq *q = REQ_QUEUE(id);
+  struct disk_info *info = REQ_INFO(id);
+  struct port *port = &ports[info->data_port];
+  struct port_iov span[2];
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  if(info->nblocks != 1 ||
+     port_size(info->data_port) != PORT_BUF_SIZE)
+    return 0;
+  if(info->mode == 'R'){
+    port->head = port->tail = 0;
+    port_reserve(info->data_port, span);
+  } else {
+    port_peek(info->data_port, span);
+  }
+  if(span[0].len < BSIZE)
+    return 0;
 
-  __sync_synchronize();
+  put_slabs(q, info);
+  info->buf[0] = span[0].buf;
+  info->zerocopy = 1;
+  disk.busy[info->data_port] = 1;
+  return 1;
+}
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+// hand a completed zero-copy request's block over to its port.
+// returns the status to report.
+static char
+zerocopy_done(int id)
+{
+  struct disk_info *info = REQ_INFO(id);
+  struct port *port = &ports[info->data_port];
 
-  __sync_synchronize();
+  disk.busy[info->data_port] = 0;
+
+  if(info->mode == 'W'){
+    // the block is consumed whether or not the write worked, as
+    // a copied one would have been. the count check guards against
+    // the port having been closed meanwhile.
+    if(port->count >= BSIZE)
+      port_consume(info->data_port, BSIZE);
+    return info->status == 0 ? 'S' : 'F';
+  }
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // a read landed at the start of the ring. if anything was
+  // written to the port while it was in flight, both are garbage,
+  // and if the port was closed there is nowhere to deliver it.
+  if(info->status != 0 || port->count != 0 ||
+     port_commit(info->data_port, BSIZE) != BSIZE)
+    return 'F';
+  return 'S';
 }
 
-void virtio_disk_intr()
+// bring the block cache up to date with request id, which is
+// about to go to the device. a write's blocks go in the cache now,
+// so that reads from here on see them.
+static void
+cache_submit(int id)
 {
-  // This function gets called in the interrupt handler
-  // when the disk has signalled an interrupt. It should do the following:
-  //   1. Acknowledge the interrupt
-  //   2. Process all completed disk operations. For each completed operation:
-  //      1. If the disk info status is not 0, write a failure response to the
-  //         message port.
-  //      2. If the disk info mode is 'R', and it succeeded,
-  //         write the data to the data port.
-  //      3. If the message succeeded, write a success response to the
-  //         message port.
-  //      4. Free the chain of descriptors. and update the used_idx.
-  //  3. Start the disk again.
-  //  HINT: This is somewhat similar to the xv6 disk interrupt, with the
-  //        differences being in the handling of errors and reporting back to
-  //        the message ports.Be sure to read the corresponding code in xv6
-  //        to understand what is happening.
-  // YOUR CODE HERE
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  struct disk_info *info = REQ_INFO(id);
+  char *data;
 
-  __sync_synchronize();
+  info->cached = disk.cache != DISK_CACHE_OFF && !info->flush &&
+                 info->mode != 'F';
+  if(!info->cached)
+    return;
+  if(info->mode == 'W' || info->mode == 'w'){
+    for(int i = 0; i < info->nblocks; i++)
+      if((data = bcache_put(info->blockid + i, 0)) != 0)
+        memmove(data, info->buf[i], BSIZE);
+  } else if(info->mode == 'z' || info->mode == 'd'){
+    // rather than fill the cache with zeroes, forget the range. a
+    // dirty block is zeroed instead, so that writing it back can't
+    // undo a 'z'. after a 'd' the dirty copy is as good as any.
+    for(uint64 b = info->blockid; b < info->blockid + info->nrange; b++){
+      if(info->mode == 'z' && bcache_dirty(b))
+        memset(bcache_put(b, 1), 0, BSIZE);
+      else
+        bcache_invalidate(b);
+    }
+  } else {
+    info->gen = bcache_gen();
+    if(!info->ahead)
+      disk.stats.cache_misses += info->nblocks;
+  }
+}
 
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+// the device has finished request id. the cache forgets the blocks
+// of a failed write. a read keeps the blocks it got, except that
+// where the cache already has a block, that copy is at least as new
+// (it may be dirty) and is what the read delivers.
+static void
+cache_done(int id)
+{
+  struct disk_info *info = REQ_INFO(id);
+  char *data;
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  if(!info->cached || info->nrange)
+    return;
+  if(info->mode == 'W' || info->mode == 'w'){
+    if(info->status != 0)
+      for(int i = 0; i < info->nblocks; i++)
+        bcache_invalidate(info->blockid + i);
+    return;
+  }
 
-    if(disk.info[id].mode == 'R' && disk.info[id].status == 'S'){
-      disk.info[id].data_port = disk.buffer[id];
-      disk.info[id].msg_port = "success";//Probably meant to use a VIRTIO_MMIO..., but can't figure out what it is
-    }
-    wakeup(disk.info[id]);
-    disk.used_idx += 1;
+  // a zero-copy read whose port was written to has nothing to give.
+  if(info->status != 0 ||
+     (info->zerocopy && ports[info->data_port].count != 0))
+    return;
+  for(int i = 0; i < info->nblocks; i++){
+    if((data = bcache_get(info->blockid + i)) != 0)
+      memmove(info->buf[i], data, BSIZE);
+    else
+      bcache_fill(info->blockid + i, info->buf[i], info->gen);
   }
 }
+
+// is any of the n blocks from blockid being written back by the
+// cache? a write of them has to wait, as the device may finish
+// the two in either order.
+static int
+cache_flushing(uint64 blockid, int n)
+{
+  if(bcache_ndirty() == 0)
+    return 0;
+  for(int i = 0; i < n; i++)
+    if(bcache_flushing(blockid + i))
+      return 1;
+  return 0;
+}
+
+// fill in the header, data and status descriptors of request id,
+// whose chain was linked by alloc_req.
+static void
+format_req(int id, uint64 sector)
+{
+  struct vq *q = REQ_QUEUE(id);
+  struct disk_info *info = REQ_INFO(id);
+  struct virtq_desc *d[MAXRUN + 2];
+  int n = info->nseg + 2;
+
+  struct virtio_blk_req *buf = &info->op;
+  if(info->mode == 'W' || info->mode == 'w')
+    buf->type = VIRTIO_BLK_T_OUT; // write the disk
+  else if(info->mode == 'F')
+    buf->type = VIRTIO_BLK_T_FLUSH; // no data, just the status
+  else if(info->mode == 'z')
+    buf->type = VIRTIO_BLK_T_WRITE_ZEROES;
+  else if(info->mode == 'd')
+    buf->type = VIRTIO_BLK_T_DISCARD;
+  else
+    buf->type = VIRTIO_BLK_T_IN; // read the disk
+  buf->reserved = 0;
+  buf->sector = sector;
+
+  if(disk.indirect || disk.packed){
+    // the chain lives in the indirect table, linked by table offset.
+    for(int i = 0; i < n; i++){
+      d[i] = &info->itable[i];
+      d[i]->next = i + 1;
+    }
+    if(!disk.packed){
+      q->desc[id % NUM].addr = (uint64) info->itable;
+      q->desc[id % NUM].len = n * sizeof(struct virtq_desc);
+      q->desc[id % NUM].flags = VRING_DESC_F_INDIRECT;
+      q->desc[id % NUM].next = 0;
+    }
+  } else {
+    for(int i = 0, j = id % NUM; i < n; i++, j = q->desc[j].next)
+      d[i] = &q->desc[j];
+  }
+
+  d[0]->addr = (uint64) buf;
+  d[0]->len = sizeof(struct virtio_blk_req);
+  d[0]->flags = VRING_DESC_F_NEXT;
+
+  if(info->nrange){
+    // the range goes in the data, and the header has no sector.
+    info->range.sector = sector;
+    info->range.num_sectors = info->nrange * (BSIZE / 512);
+    info->range.flags = 0;
+    if(info->mode == 'z' && disk.unmap)
+      info->range.flags = VIRTIO_BLK_DWZ_F_UNMAP;
+    buf->sector = 0;
+    d[1]->addr = (uint64) &info->range;
+    d[1]->len = sizeof(info->range);
+    d[1]->flags = VRING_DESC_F_NEXT; // device reads the range
+  }
+
+  // blocks that follow on from each other in memory share a data
+  // segment, up to as long as the device takes, as buf_nseg counted.
+  for(int i = 0, s = 0, len = 0; i < info->nblocks; i++, len++){
+    if(!seg_starts(info->buf, i, len)){
+      d[s]->len += BSIZE;
+      continue;
+    }
+    len = 0;
+    s++;
+    d[s]->addr = (uint64) info->buf[i];
+    d[s]->len = BSIZE;
+    if(buf->type == VIRTIO_BLK_T_OUT)
+      d[s]->flags = 0; // device reads the buffer
+    else
+      d[s]->flags = VRING_DESC_F_WRITE; // device writes the buffer
+    d[s]->flags |= VRING_DESC_F_NEXT;
+  }
+
+  info->status = 0xff; // device writes 0 on success
+  d[n-1]->addr = (uint64) &info->status;
+  d[n-1]->len = 1;
+  d[n-1]->flags = VRING_DESC_F_WRITE; // device writes the status
+  d[n-1]->next = 0;
+}
+
+// has an index moved from old to new past event, the index at
+// which the other side asked to hear from us? all mod 2^16.
+static int
+need_event(uint16 event, uint16 new, uint16 old)
+{
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
+
+// put request id, formatted in its indirect table, in the next
+// descriptors of the packed ring. unlike the split ring the device
+// may see it straight away, so the head goes in last.
+static void
+place_packed(int id)
+{
+  struct vq *q = REQ_QUEUE(id);
+  struct disk_info *info = REQ_INFO(id);
+  struct virtq_pdesc *table = (struct virtq_pdesc *) info->itable;
+  int n = info->nseg + 2;
+  int head = q->next_avail;
+  uint16 head_flags = 0;
+
+  if(disk.indirect){
+    // the device reads the table in the packed layout, in order
+    // rather than linked.
+    for(int i = 0; i < n; i++){
+      uint16 flags = info->itable[i].flags & ~VRING_DESC_F_NEXT;
+      table[i].id = 0;
+      table[i].flags = flags;
+    }
+  }
+
+  for(int i = 0; i < info->ndesc; i++){
+    struct virtq_pdesc *d = &q->pdesc[q->next_avail];
+    uint16 flags;
+    if(disk.indirect){
+      d->addr = (uint64) table;
+      d->len = n * sizeof(struct virtq_pdesc);
+      flags = VRING_DESC_F_INDIRECT;
+    } else {
+      d->addr = info->itable[i].addr;
+      d->len = info->itable[i].len;
+      flags = info->itable[i].flags;
+    }
+    d->id = id % NUM;
+    flags |= q->avail_wrap ? VRING_PACKED_DESC_F_AVAIL
+                             : VRING_PACKED_DESC_F_USED;
+    if(i == 0)
+      head_flags = flags;
+    else
+      d->flags = flags;
+
+    if(++q->next_avail == q->num){
+      q->next_avail = 0;
+      q->avail_wrap ^= 1;
+    }
+  }
+
+  __sync_synchronize();
+  q->pdesc[head].flags = head_flags;
+  q->npending += info->ndesc;
+}
+
+// count v in hist, a stats histogram of n log2 buckets.
+static void
+hist_add(uint64 *hist, int n, uint64 v)
+{
+  int b = 0;
+
+  while(b < n - 1 && (v >> (b + 1)) != 0)
+    b++;
+  hist[b] += 1;
+}
+
+// queue request id for the device. it is not seen until the
+// next publish(), so that a batch of requests costs one doorbell.
+static void
+submit_req(int id)
+{
+  struct vq *q = REQ_QUEUE(id);
+
+  cache_submit(id);
+  format_req(id, REQ_INFO(id)->blockid * (BSIZE / 512));
+
+  if(disk.packed){
+    place_packed(id);
+  } else {
+    // the first index in our chain of descriptors goes in the
+    // first avail ring entry the device hasn't been told about.
+    q->avail->ring[(q->avail->idx + q->npending) % q->num] = id % NUM;
+    q->npending += 1;
+  }
+  disk.ninflight += 1;
+  disk.stats.requests += 1;
+  disk.stats.segments += REQ_INFO(id)->nseg;
+  if(is_write(REQ_INFO(id)->mode))
+    disk.nwrites += 1;
+  REQ_INFO(id)->start = r_time();
+  hist_add(disk.stats.lat_queue, DISK_LAT_BUCKETS,
+           REQ_INFO(id)->start - REQ_INFO(id)->queued);
+  hist_add(disk.stats.depth, DISK_DEPTH_BUCKETS, disk.ninflight);
+}
+
+// publish() for a packed ring, whose chains the device can
+// already see. all that is left is to notify, if it wants that.
+static void
+publish_packed(struct vq *q)
+{
+  uint16 new = q->next_avail;
+  uint16 old = new - q->npending;
+  uint16 off_wrap, event;
+
+  q->npending = 0;
+
+  __sync_synchronize();
+
+  off_wrap = q->device_event->off_wrap;
+  switch(q->device_event->flags){
+  case VRING_PACKED_EVENT_FLAG_DISABLE:
+    return;
+  case VRING_PACKED_EVENT_FLAG_DESC:
+    // an event position from the previous lap is behind us.
+    event = off_wrap & 0x7fff;
+    if((off_wrap >> 15) != q->avail_wrap)
+      event -= q->num;
+    if(!need_event(event, new, old))
+      return;
+  }
+
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q->qid;
+  disk.stats.notifies += 1;
+}
+
+// tell the device about the requests queued by submit_req.
+static void
+publish(struct vq *q)
+{
+  if(q->npending == 0)
+    return;
+  if(disk.packed){
+    publish_packed(q);
+    return;
+  }
+
+  uint16 old = q->avail->idx;
+
+  __sync_synchronize();
+
+  // tell the device the new avail ring entries are available.
+  q->avail->idx += q->npending; // not % num ...
+  q->npending = 0;
+
+  __sync_synchronize();
+
+  // with event_idx, a device that is still working through the
+  // ring will pick these up without being told.
+  if(disk.event_idx &&
+     !need_event(*q->avail_event, q->avail->idx, old))
+    return;
+
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q->qid;
+  disk.stats.notifies += 1;
+}
+
+// is port p an open port the driver may use?
+static int
+valid_port(unsigned int p)
+{
+  return p < NPORT && !ports[p].free;
+}
+
+// start streaming request id's data through its data port.
+static void
+stream_req(int id)
+{
+  REQ_INFO(id)->nbytes = 0;
+  REQ_INFO(id)->next = disk.stream;
+  disk.stream = id;
+}
+
+// move as much streamed data as the data ports allow. reads are
+// copied out of their buffers into the port, and writes are
+// gathered from the port into their buffers and then submitted.
+static void
+stream_data()
+{
+  int *pp = &disk.stream;
+
+  while(*pp >= 0){
+    int id = *pp;
+    struct disk_info *info = REQ_INFO(id);
+    struct port *port = &ports[info->data_port];
+    int total = info->nblocks * BSIZE;
+
+    while(info->nbytes < total && !port->free){
+      int off = info->nbytes % BSIZE;
+      int n = BSIZE - off;
+      char *buf = info->buf[info->nbytes / BSIZE] + off;
+      if(info->mode == 'r'){
+        if(n > port_size(info->data_port) - port->count)
+          n = port_size(info->data_port) - port->count;
+        n = port_write(info->data_port, buf, n);
+      } else {
+        if(n > port->count)
+          n = port->count;
+        n = port_read(info->data_port, buf, n);
+      }
+      if(n <= 0)
+        break;
+      info->nbytes += n;
+    }
+
+    if(info->nbytes < total && !port->free){
+      // come back when the port has moved on.
+      pp = &info->next;
+      continue;
+    }
+    if(info->mode == 'w' && info->nbytes == total &&
+       cache_flushing(info->blockid, info->nblocks)){
+      pp = &info->next;
+      continue;
+    }
+
+    // finished with the data port, or it was closed under us.
+    *pp = info->next;
+    disk.busy[info->data_port] = 0;
+    if(info->mode == 'r')
+      free_req(id);
+    else if(info->nbytes < total){
+      write_disk_response('F', id);
+      free_req(id);
+    } else
+      submit_req(id);
+  }
+}
+
+// the command each DISK_BIO_* op is treated as.
+static char bio_modes[] = { 'r', 'w', 'F', 'z', 'd' };
+#define NBIO_OPS (sizeof(bio_modes) / sizeof(bio_modes[0]))
+
+// release bio request id, which worked if its status is 0, and
+// hand the bio back to its submitter.
+static void
+bio_done(int id)
+{
+  struct disk_info *info = REQ_INFO(id);
+  struct bio *b = info->bio;
+  int ok = info->status == 0;
+
+  if(!ok)
+    disk.stats.failures += 1;
+  else if(info->mode == 'r')
+    disk.stats.bytes_read += info->nblocks * BSIZE;
+  else
+    disk.stats.bytes_written += info->nblocks * BSIZE;
+  free_req(id);
+
+  b->status = ok ? 0 : -1;
+  disk.completing = 1;
+  if(b->done)
+    b->done(b);
+  disk.completing = 0;
+}
+
+// answer port command id, which the device has finished with,
+// and release it.
+static void
+port_done(int id)
+{
+  struct disk_info *info = REQ_INFO(id);
+
+  if(info->zerocopy){
+    write_disk_response(zerocopy_done(id), id);
+  } else if(info->status != 0){
+    write_disk_response('F', id);
+    if(info->mode == 'r')
+      disk.busy[info->data_port] = 0;
+  } else if(info->mode == 'r'){
+    // report success now; the data follows as the port drains.
+    write_disk_response('S', id);
+    stream_req(id);
+    return;
+  } else if(info->mode == 'R' &&
+            port_size(info->data_port) - ports[info->data_port].count <
+            BSIZE){
+    // someone filled the data port while the read was in flight.
+    write_disk_response('F', id);
+  } else if(info->mode == 'R' &&
+            port_write(info->data_port, info->buf[0], BSIZE) != BSIZE){
+    // the data port was closed while the read was in flight.
+    write_disk_response('F', id);
+  } else {
+    write_disk_response('S', id);
+  }
+
+  free_req(id);
+}
+
+// the cache's write-back request id is on the disk, unless it
+// failed, in which case its blocks stay dirty.
+static void
+writeback_done(int id)
+{
+  struct disk_info *info = REQ_INFO(id);
+
+  if(info->status != 0)
+    disk.stats.writeback_fails += 1;
+  for(int i = 0; i < info->nblocks; i++)
+    bcache_flushed(info->blockid + i, info->status == 0);
+  free_req(id);
+}
+
+// read-ahead request id has put its blocks in the cache.
+static void
+ahead_done(int id)
+{
+  struct disk_info *info = REQ_INFO(id);
+
+  disk.ra[info->data_port].pending--;
+  free_req(id);
+}
+
+// request id is back from the device: bring the cache up to date
+// and hand it to its done callback.
+static void
+complete_req(int id)
+{
+  struct disk_info *info = REQ_INFO(id);
+
+  if(is_write(info->mode))
+    disk.nwrites -= 1;
+  if(id == disk.barrier)
+    disk.barrier = -1;
+
+  cache_done(id);
+  info->done(id);
+}
+
+// record the latency of a finished request in hist, one of the
+// stats histograms, and in the moving average.
+static void
+record_lat(uint64 start, uint64 *hist)
+{
+  uint64 lat = r_time() - start;
+
+  hist_add(hist, DISK_LAT_BUCKETS, lat);
+  disk.lat = (disk.lat * 7 + lat) / 8;
+}
+
+// turn device interrupts off (polling) or back on.
+static void
+set_polling(int on)
+{
+  if(on == disk.polling)
+    return;
+  disk.polling = on;
+  disk.stats.switches += 1;
+
+  for(struct vq *q = disk.q; q < &disk.q[disk.nqueue]; q++){
+    if(disk.packed){
+      q->driver_event->off_wrap = q->next_used | q->used_wrap << 15;
+      if(on)
+        q->driver_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+      else if(disk.event_idx)
+        q->driver_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+      else
+        q->driver_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    } else {
+      // with event_idx the flags are ignored, and the device
+      // interrupts as the used index passes used_event. one behind
+      // where it is now is as far off as it can be.
+      q->avail->flags = on ? VRING_AVAIL_F_NO_INTERRUPT : 0;
+      if(disk.event_idx)
+        *q->used_event = on ? q->used_idx - 1 : q->used_idx;
+    }
+  }
+  __sync_synchronize();
+}
+
+// in DISK_MODE_ADAPTIVE, pick polling or interrupts for what
+// comes next, going by how the last requests went.
+static void
+adapt(void)
+{
+  if(disk.mode != DISK_MODE_ADAPTIVE)
+    return;
+  if(!disk.polling && disk.lat < POLL_LAT && disk.ninflight <= POLL_QMAX)
+    set_polling(1);
+  else if(disk.polling &&
+          (disk.lat > 2 * POLL_LAT || disk.ninflight > POLL_QMAX))
+    set_polling(0);
+}
+
+// has the device finished with another request?
+static int
+used_ready(struct vq *q)
+{
+  if(disk.packed){
+    // a used descriptor has both flags set to the wrap counter.
+    uint16 flags = ((volatile struct virtq_pdesc *)
+                    &q->pdesc[q->next_used])->flags;
+    int avail = (flags & VRING_PACKED_DESC_F_AVAIL) != 0;
+    int used = (flags & VRING_PACKED_DESC_F_USED) != 0;
+    return avail == q->used_wrap && used == q->used_wrap;
+  }
+
+  // the device increments q->used->idx when it
+  // adds an entry to the used ring.
+  return q->used_idx != q->used->idx;
+}
+
+// take the next finished request, as seen by used_ready, and
+// return its id.
+static int
+pop_used(struct vq *q)
+{
+  int id;
+
+  if(disk.packed){
+    // the device writes one used descriptor per chain, and then
+    // skips as many descriptors as the chain took.
+    id = q->pdesc[q->next_used].id;
+    q->next_used += q->info[id]->ndesc;
+    if(q->next_used >= q->num){
+      q->next_used -= q->num;
+      q->used_wrap ^= 1;
+    }
+    return REQ(q, id);
+  }
+
+  id = q->used->ring[q->used_idx % q->num].id;
+  q->used_idx += 1;
+  return REQ(q, id);
+}
+
+// complete the requests the device has put on the used ring,
+// recording their latencies in hist. returns how many there were.
+static int
+reap(uint64 *hist)
+{
+  int n = 0;
+  int more = 1;
+
+  // the device has one interrupt for all of its queues.
+  while(more){
+    more = 0;
+    for(struct vq *q = disk.q; q < &disk.q[disk.nqueue]; q++){
+      while(used_ready(q)){
+        __sync_synchronize();
+        int id = pop_used(q);
+        disk.ninflight -= 1;
+        record_lat(REQ_INFO(id)->start, hist);
+        complete_req(id);
+        n++;
+      }
+    }
+
+    adapt();
+    if(disk.polling)
+      break;
+
+    // ask for an interrupt at the next completion, then look
+    // again in case one arrived before the device could see that,
+    // or while interrupts were off for polling.
+    for(struct vq *q = disk.q; q < &disk.q[disk.nqueue]; q++){
+      if(disk.packed && disk.event_idx)
+        q->driver_event->off_wrap = q->next_used | q->used_wrap << 15;
+      else if(disk.event_idx)
+        *q->used_event = q->used_idx;
+    }
+    __sync_synchronize();
+    for(struct vq *q = disk.q; q < &disk.q[disk.nqueue]; q++)
+      more |= used_ready(q);
+  }
+
+  if(hist == disk.stats.lat_poll)
+    disk.stats.polled += n;
+  return n;
+}
+
+// the queue for the next command: the one for the current hart,
+// or with virtio_disk_spread, each of the first few in turn.
+static struct vq *
+submit_queue(void)
+{
+  if(disk.spread)
+    return &disk.q[disk.next_queue % disk.spread];
+  return &disk.q[r_tp() % disk.nqueue];
+}
+
+// answer an 'R' from the block cache, or in write-back mode keep
+// a 'W' in it, without going to the device. anything the cache
+// can't do, including every command that would fail, is left for
+// start_msg. returns 1 if the command was answered.
+static int
+cache_msg(struct disk_msg *msg)
+{
+  struct port *port;
+  char *data;
+  int superseded;
+
+  if(disk.cache == DISK_CACHE_OFF || msg->nblocks != 1 ||
+     !on_disk(msg->blockid, 1) ||
+     !valid_port(msg->msg_port) || !valid_port(msg->data_port) ||
+     disk.busy[msg->data_port])
+    return 0;
+  port = &ports[msg->data_port];
+
+  if(msg->mode == 'R' && port->count == 0 &&
+     (data = bcache_get(msg->blockid)) != 0){
+    port_write(msg->data_port, data, BSIZE);
+    disk.stats.cache_hits += 1;
+    disk.stats.bytes_read += BSIZE;
+  } else if(msg->mode == 'W' && disk.cache == DISK_CACHE_WRITEBACK &&
+            port->count == BSIZE){
+    // a block that is still waiting to be written back is replaced,
+    // and the disk never sees the write it had.
+    superseded = bcache_dirty(msg->blockid);
+    if((data = bcache_put(msg->blockid, 1)) == 0)
+      return 0;
+    port_read(msg->data_port, data, BSIZE);
+    disk.stats.cache_absorbed += 1;
+    disk.stats.cache_superseded += superseded;
+    disk.stats.bytes_written += BSIZE;
+  } else {
+    return 0;
+  }
+
+  send_response(msg->msg_port, msg->binary, msg->tagged, msg->mode, 'S',
+                msg->blockid, msg->tag);
+  return 1;
+}
+
+// write dirty blocks back from the cache, as far as the ring has
+// room: in write-back mode enough that no more than half the cache
+// waits, plus any that have waited WB_EXPIRE, and otherwise all of
+// them.
+// neighbouring blocks go in one request, and the requests go in
+// the order bcache_next_run picks.
+static void
+cache_writeback(void)
+{
+  struct vq *q = submit_queue();
+  int limit = disk.cache == DISK_CACHE_WRITEBACK ? NBCACHE / 2 : 0;
+  int max = disk.indirect ? disk.maxrun : q->num - 2;
+  uint64 expired = r_time() > WB_EXPIRE ? r_time() - WB_EXPIRE : 0;
+  uint64 blockid;
+  int id, n;
+
+  // blocks dirtied after an 'F' wait for it to finish, and an 'F'
+  // that is waiting needs every block dirtied before it.
+  if(disk.barrier >= 0)
+    return;
+  if(disk.draining)
+    limit = 0;
+  if(max > disk.maxrun)
+    max = disk.maxrun;
+  while(bcache_nwaiting() > limit || bcache_expired(expired)){
+    if((n = bcache_next_run(&blockid, max, expired)) == 0)
+      return;
+    if((id = alloc_req(q, n, 0, 0)) < 0)
+      return;
+    for(int i = 0; i < n; i++)
+      bcache_flush(blockid + i, REQ_INFO(id)->buf[i]);
+    REQ_INFO(id)->mode = 'w';
+    REQ_INFO(id)->blockid = blockid;
+    REQ_INFO(id)->flush = 1;
+    REQ_INFO(id)->done = writeback_done;
+    submit_req(id);
+    disk.stats.cache_writebacks += n;
+    disk.stats.writeback_reqs += 1;
+  }
+}
+
+// called for each 'R' command msg that was accepted, with hit
+// set if the cache answered it. when the reads through a data port
+// follow on from each other, keep the next window blocks read
+// ahead into the cache. the window doubles while most reads of
+// blocks read ahead hit, and halves while most miss, because the
+// blocks were evicted or had not arrived yet.
+static void
+readahead(struct disk_msg *msg, int hit)
+{
+  struct ra *ra = &disk.ra[msg->data_port];
+  struct vq *q = submit_queue();
+  uint64 end = msg->blockid + msg->nblocks;
+  int id, n;
+
+  if(disk.cache == DISK_CACHE_OFF || disk.ra_max == 0)
+    return;
+
+  if(msg->blockid != ra->next){
+    ra->run = 0;
+    ra->window = RA_MIN < disk.ra_max ? RA_MIN : disk.ra_max;
+    ra->ahead = end;
+    ra->tries = ra->hits = 0;
+  } else {
+    ra->run++;
+    if(msg->blockid < ra->ahead){
+      ra->tries++;
+      ra->hits += hit;
+      disk.stats.readahead_hits += hit;
+    }
+  }
+  ra->next = end;
+
+  if(ra->tries >= ra->window){
+    if(ra->hits * 4 >= ra->tries * 3 && ra->window * 2 <= disk.ra_max)
+      ra->window *= 2;
+    else if(ra->hits * 2 < ra->tries && ra->window / 2 >= RA_MIN)
+      ra->window /= 2;
+    ra->tries = ra->hits = 0;
+  }
+
+  if(ra->run == 0)
+    return;
+  if(ra->ahead < end)
+    ra->ahead = end;
+
+  // read ahead in runs, leaving half the ring for commands, and
+  // stopping at the end of the disk.
+  while(ra->ahead < end + ra->window && ra->ahead < disk.nblocks){
+    if(bcache_cached(ra->ahead)){
+      ra->ahead++;
+      continue;
+    }
+    n = end + ra->window - ra->ahead;
+    if(n > disk.maxrun)
+      n = disk.maxrun;
+    if(n > disk.nblocks - ra->ahead)
+      n = disk.nblocks - ra->ahead;
+    if(q->nfree - req_ndesc(req_nseg(n)) < q->num / 2 ||
+       (id = alloc_req(q, n, 0, 0)) < 0)
+      return;
+    REQ_INFO(id)->mode = 'r';
+    REQ_INFO(id)->blockid = ra->ahead;
+    REQ_INFO(id)->data_port = msg->data_port;
+    REQ_INFO(id)->ahead = 1;
+    REQ_INFO(id)->done = ahead_done;
+    submit_req(id);
+    disk.stats.readahead += n;
+    ra->ahead += n;
+    ra->pending++;
+  }
+}
+
+// should 'R' command msg, which missed the cache, wait for blocks
+// still being read ahead rather than read its block again? this
+// holds up the commands behind it too, but only until the device
+// answers requests it already has.
+static int
+readahead_wait(struct disk_msg *msg)
+{
+  struct ra *ra;
+
+  if(msg->mode != 'R' || disk.cache == DISK_CACHE_OFF ||
+     !valid_port(msg->data_port))
+    return 0;
+  ra = &disk.ra[msg->data_port];
+  return ra->pending > 0 && ra->run > 0 && msg->blockid == ra->next &&
+         msg->blockid < ra->ahead;
+}
+
+// must a command of mode wait because of an 'F'? writes wait while one
+// is in flight, so that they finish after it. an 'F' also waits
+// for every write before it to finish, including the blocks the
+// cache has yet to write back.
+static int
+barrier_wait(char mode)
+{
+  if(!is_write(mode) && mode != 'F')
+    return 0;
+  if(disk.barrier >= 0)
+    return 1;
+  if(mode != 'F')
+    return 0;
+  if(disk.nwrites > 0 || bcache_ndirty() > 0)
+    return 1;
+  for(int id = disk.stream; id >= 0; id = REQ_INFO(id)->next)
+    if(REQ_INFO(id)->mode == 'w')
+      return 1;
+  return 0;
+}
+
+// could a command of mode on nblocks blocks from blockid ever be
+// carried out? a data command moves 1 to disk.maxrun blocks, and a
+// range command covers as many as the device takes at once. either
+// has to be on the disk, and the ring has to be able to hold it.
+static int
+fits(char mode, uint64 blockid, int nblocks)
+{
+  if(mode == 'F')
+    return 1;
+  if(!on_disk(blockid, nblocks))
+    return 0;
+  if(mode == 'z')
+    return disk.zeroes &&
+           (disk.max_zeroes == 0 || nblocks <= disk.max_zeroes);
+  if(mode == 'd')
+    return !disk.discard || disk.max_discard == 0 ||
+           nblocks <= disk.max_discard;
+  return nblocks <= disk.maxrun &&
+         req_ndesc(req_nseg(nblocks)) <= disk.q[0].num;
+}
+
+// commands and bios are started alike, by the helpers below, and
+// finish alike, through their requests' done callbacks. a command
+// isn't turned into a bio, since its data comes and goes through
+// ports, a block at a time or streamed, where a bio has all of its
+// data in one place.
+
+// must a command or bio of mode on nblocks blocks from blockid wait
+// before it is started, for a write-back of those blocks or an 'F'?
+static int
+start_wait(char mode, uint64 blockid, int nblocks)
+{
+  if((mode == 'W' || mode == 'w' || is_range(mode)) &&
+     cache_flushing(blockid, nblocks))
+    return 1;
+  if(!barrier_wait(mode))
+    return 0;
+  // an 'F' that waits has the cache write back all it holds.
+  if(mode == 'F')
+    disk.draining = 1;
+  return 1;
+}
+
+// allocate a request for a command or bio of mode on nblocks blocks
+// from blockid. an 'F' is just a header and a status, and a range
+// command has its range in place of the blocks. returns -1, having
+// counted the stall, if there is no room for it yet.
+static int
+start_alloc(struct vq *q, char mode, uint64 blockid, int nblocks,
+            struct bio *b)
+{
+  int id;
+
+  id = alloc_req(q, mode == 'F' || is_range(mode) ? 0 : nblocks,
+                 is_range(mode), b);
+  if(id < 0){
+    disk.stats.stalls += 1;
+    return -1;
+  }
+  disk.next_queue++;
+  REQ_INFO(id)->mode = mode;
+  REQ_INFO(id)->blockid = blockid;
+  return id;
+}
+
+// submit request id, an 'F' or a range command of nrange blocks.
+// returns 0 without submitting it if the device has nothing to do,
+// in which case it has already worked: without a flush command the
+// device doesn't cache writes, so the ones before an 'F' are on the
+// disk, and a device that can't discard keeps what it has, which is
+// all a discard promises.
+static int
+start_nodata(int id, int nrange)
+{
+  struct disk_info *info = REQ_INFO(id);
+
+  if((info->mode == 'F' && !disk.flush) ||
+     (info->mode == 'd' && !disk.discard))
+    return 0;
+  if(info->mode == 'F'){
+    disk.barrier = id;
+    disk.stats.flushes += 1;
+  } else {
+    info->nrange = nrange;
+    if(info->mode == 'z')
+      disk.stats.zeroed += nrange;
+    else
+      disk.stats.discarded += nrange;
+  }
+  submit_req(id);
+  return 1;
+}
+
+// start the bio at the head of disk.bios, which virtio_disk_submit
+// checked could be carried out. it waits as a command would, but
+// nothing else stands between it and the ring. returns 0 if there
+// is no bio, or it has to wait.
+static int
+start_bio(void)
+{
+  struct bio *b = disk.bios;
+  char mode;
+  int id;
+
+  if(b == 0)
+    return 0;
+  mode = bio_modes[b->op];
+  if(start_wait(mode, b->blockid, b->nblocks))
+    return 0;
+  id = start_alloc(submit_queue(), mode, b->blockid, b->nblocks, b);
+  if(id < 0)
+    return 0;
+  if((disk.bios = b->next) == 0)
+    disk.bios_tail = 0;
+  REQ_INFO(id)->done = bio_done;
+
+  if(mode == 'F' || is_range(mode)){
+    if(!start_nodata(id, b->nblocks)){
+      REQ_INFO(id)->status = 0;
+      bio_done(id);
+    }
+    return 1;
+  }
+  submit_req(id);
+  return 1;
+}
+
+// take the next message off PORT_DISKCMD and act on it. returns
+// 0 if there is no message, or no room on the ring for it yet.
+static int
+start_msg(void)
+{
+  struct disk_msg msg;
+  char buf[MSGMAX];
+  int id;
+
+  // is there a message waiting, and room on the ring for it?
+  msg = get_disk_msg();
+  if(msg.len == 0)
+    return 0;
+  if(cache_msg(&msg)){
+    port_read(PORT_DISKCMD, buf, msg.len);
+    if(msg.mode == 'R')
+      readahead(&msg, 1);
+    return 1;
+  }
+  if(readahead_wait(&msg) ||
+     start_wait(msg.mode, msg.blockid, msg.nblocks))
+    return 0;
+
+  if(fits(msg.mode, msg.blockid, msg.nblocks)){
+    id = start_alloc(submit_queue(), msg.mode, msg.blockid, msg.nblocks, 0);
+    if(id < 0)
+      return 0;
+  } else {
+    // can never be satisfied; it is failed below.
+    id = -1;
+  }
+  port_read(PORT_DISKCMD, buf, msg.len);
+
+  if(!valid_port(msg.msg_port)){
+    // nowhere to report to, so just drop the message.
+    if(id >= 0)
+      free_req(id);
+    return 1;
+  }
+
+  if(id < 0){
+    send_response(msg.msg_port, msg.binary, msg.tagged, msg.mode, 'F',
+                  msg.blockid, msg.tag);
+    return 1;
+  }
+
+  REQ_INFO(id)->data_port = msg.data_port;
+  REQ_INFO(id)->msg_port = msg.msg_port;
+  REQ_INFO(id)->binary = msg.binary;
+  REQ_INFO(id)->tagged = msg.tagged;
+  REQ_INFO(id)->tag = msg.tag;
+  REQ_INFO(id)->done = port_done;
+
+  // the data port of an 'F' or a range command is not used.
+  if(msg.mode == 'F' || is_range(msg.mode)){
+    if(!start_nodata(id, msg.nblocks)){
+      REQ_INFO(id)->status = 0;
+      port_done(id);
+    }
+    return 1;
+  }
+
+  // a write needs exactly one block waiting in its data port, and
+  // a read needs an empty port to deliver into. the streaming forms
+  // need a port that no other command is streaming through.
+  if(!valid_port(msg.data_port) || disk.busy[msg.data_port] ||
+     (msg.mode == 'W' && ports[msg.data_port].count != BSIZE) ||
+     ((msg.mode == 'R' || msg.mode == 'r') &&
+      ports[msg.data_port].count != 0) ||
+     (msg.mode != 'W' && msg.mode != 'R' &&
+      msg.mode != 'w' && msg.mode != 'r')){
+    write_disk_response('F', id);
+    free_req(id);
+    return 1;
+  }
+
+  if(msg.mode == 'r' || msg.mode == 'w')
+    disk.busy[msg.data_port] = 1;
+
+  if(msg.mode == 'w'){
+    // submitted once all of its data has arrived.
+    stream_req(id);
+    stream_data();
+  } else {
+    // 'R' and 'W' skip the DMA buffer when they can.
+    if(msg.mode == 'R')
+      zerocopy_req(id);
+    else if(msg.mode == 'W' && !zerocopy_req(id))
+      port_read(msg.data_port, REQ_INFO(id)->buf[0], BSIZE);
+    submit_req(id);
+  }
+  if(msg.mode == 'R')
+    readahead(&msg, 0);
+  return 1;
+}
+
+// a query on PORT_DISKSTAT: 'S' and the port to answer on.
+#define STATMSG 5
+
+_Static_assert(sizeof(struct disk_stats) <= PORT_BUF_SIZE,
+               "disk stats must fit in a port");
+
+// answer the queries waiting on PORT_DISKSTAT, as long as their
+// ports have room for the answer. anything else is dropped.
+static void
+stat_msgs(void)
+{
+  char buf[STATMSG];
+  int p;
+
+  while(ports[PORT_DISKSTAT].count >= STATMSG){
+    peek_bytes(PORT_DISKSTAT, buf, STATMSG);
+    p = msg_field(buf + 1, 4);
+    if(buf[0] == 'S' && valid_port(p)){
+      if(port_size(p) - ports[p].count < sizeof(disk.stats))
+        return;
+      port_write(p, (char *) &disk.stats, sizeof(disk.stats));
+    }
+    port_read(PORT_DISKSTAT, buf, STATMSG);
+  }
+}
+
+// start processing disk messages, as many as the ring has room
+// for, and then tell the device about all of them at once.
+void virtio_disk_start()
+{
+  int intr;
+
+  // the interrupt handler also starts the disk, so keep it out
+  // while the rings are being updated.
+  intr = intr_get();
+  intr_off();
+
+  // nothing else will reap completions while polling.
+  if(disk.polling)
+    reap(disk.stats.lat_poll);
+
+  disk.draining = 0;
+  stream_data();
+  while(start_bio())
+    ;
+  while(start_msg())
+    ;
+  cache_writeback();
+  stat_msgs();
+  for(int i = 0; i < disk.nqueue; i++)
+    publish(&disk.q[i]);
+
+  if(intr)
+    intr_on();
+}
+
+int
+virtio_disk_poll(void)
+{
+  int n;
+  int intr;
+
+  intr = intr_get();
+  intr_off();
+  n = reap(disk.stats.lat_poll);
+  virtio_disk_start();
+  if(intr)
+    intr_on();
+  return n;
+}
+
+int
+virtio_disk_polled(void)
+{
+  return disk.polling && disk.ninflight > 0;
+}
+
+void
+virtio_disk_mode(int mode)
+{
+  int intr;
+
+  intr = intr_get();
+  intr_off();
+  disk.mode = mode;
+  if(mode != DISK_MODE_ADAPTIVE){
+    set_polling(mode == DISK_MODE_POLL);
+    // pick up anything that finished while interrupts were off,
+    // and start what that made room for, or what the done()
+    // callbacks of bios submitted.
+    reap(disk.stats.lat_poll);
+    virtio_disk_start();
+  }
+  if(intr)
+    intr_on();
+}
+
+int
+virtio_disk_cache(int mode)
+{
+  uint64 fails = disk.stats.writeback_fails;
+  int intr, lost = 0;
+
+  // the cache holds BSIZE blocks, which a device with larger ones
+  // can't write on their own.
+  if(disk.lbs > 1)
+    mode = DISK_CACHE_OFF;
+  intr = intr_get();
+  intr_off();
+  disk.cache = mode;
+
+  // nothing may go to the disk around dirty blocks, so write them
+  // all back before returning. once WB_TRIES write-backs have failed,
+  // whatever is still dirty when the rest are done is given up on.
+  while(mode != DISK_CACHE_WRITEBACK && bcache_ndirty() > 0){
+    if(disk.stats.writeback_fails - fails >= WB_TRIES &&
+       bcache_nwaiting() == bcache_ndirty()){
+      lost = bcache_drop_dirty();
+      disk.stats.writeback_lost += lost;
+      break;
+    }
+    virtio_disk_start();
+    reap(disk.stats.lat_poll);
+  }
+  if(mode == DISK_CACHE_OFF)
+    bcache_clear();
+  if(intr)
+    intr_on();
+  return lost ? -1 : 0;
+}
+
+void
+virtio_disk_readahead(int max)
+{
+  int intr;
+
+  // blocks read ahead should not be evicted before they are used.
+  if(max > NBCACHE / 4)
+    max = NBCACHE / 4;
+  if(max > DISK_READAHEAD)
+    max = DISK_READAHEAD;
+  if(max < 0)
+    max = 0;
+  intr = intr_get();
+  intr_off();
+  disk.ra_max = max;
+  for(int p = 0; p < NPORT; p++)
+    if(disk.ra[p].window > max)
+      disk.ra[p].window = max;
+  if(intr)
+    intr_on();
+}
+
+int
+virtio_disk_wcache(int on)
+{
+  if(!disk.wce)
+    return disk.flush;
+  *(volatile uint8 *)
+    R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_WRITEBACK) = on != 0;
+  return on != 0;
+}
+
+int
+virtio_disk_submit(struct bio *b)
+{
+  int intr;
+  char mode;
+
+  if(b->op < 0 || b->op >= NBIO_OPS)
+    return -1;
+  mode = bio_modes[b->op];
+  if(!fits(mode, b->blockid, b->nblocks) ||
+     ((mode == 'r' || mode == 'w') && b->data == 0))
+    return -1;
+
+  intr = intr_get();
+  intr_off();
+  b->next = 0;
+  if(disk.bios_tail)
+    disk.bios_tail->next = b;
+  else
+    disk.bios = b;
+  disk.bios_tail = b;
+  if(!disk.completing)
+    virtio_disk_start();
+  if(intr)
+    intr_on();
+  return 0;
+}
+
+uint64
+virtio_disk_nblocks(void)
+{
+  return disk.nblocks;
+}
+
+int
+virtio_disk_blocksize(void)
+{
+  return disk.lbs * BSIZE;
+}
+
+void
+virtio_disk_stats(struct disk_stats *st)
+{
+  *st = disk.stats;
+}
+
+void virtio_disk_intr()
+{
+  // the device won't raise another interrupt until we tell it
+  // we've seen this one.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  disk.stats.interrupts += 1;
+
+  __sync_synchronize();
+
+  reap(disk.stats.lat_intr);
+
+  // descriptors were freed, so queued messages may now fit.
+  virtio_disk_start();
+}
+
+uint64
+virtio_disk_bench_alloc(int depth, int n)
+{
+  struct vq *q = &disk.q[0];
+  uint64 start, t;
+  int held, id;
+  int intr;
+
+  if(depth < 4 || depth > q->nfree)
+    return 0;
+
+  intr = intr_get();
+  intr_off();
+  held = alloc_chain(q, depth - 3);
+  start = r_time();
+  for(int i = 0; i < n; i++){
+    id = alloc_chain(q, 3);
+    free_chain(q, id);
+  }
+  t = r_time() - start;
+  free_chain(q, held);
+  if(intr)
+    intr_on();
+  return t;
+}
+
+int
+virtio_disk_spread(int n)
+{
+  int intr;
+
+  if(n > disk.nqueue)
+    n = disk.nqueue;
+  if(n < 0)
+    n = 0;
+  intr = intr_get();
+  intr_off();
+  disk.spread = n;
+  disk.next_queue = 0;
+  if(intr)
+    intr_on();
+  return n;
+}
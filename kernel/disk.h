@@ -1,6 +1,8 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "types.h"
+
 /* 
  * Initialize the disk driver.
  */
@@ -16,7 +18,221 @@ void virtio_disk_intr(void);
  */
 void virtio_disk_start(void);
 
+/*
+ * Reap finished disk operations without waiting for an interrupt,
+ * then start any queued ones, as virtio_disk_start does.
+ * Returns the number of operations reaped.
+ */
+int virtio_disk_poll(void);
+
+/*
+ * Are operations in flight that the device won't interrupt for, so
+ * that only virtio_disk_poll or virtio_disk_start will see them
+ * finish?
+ */
+int virtio_disk_polled(void);
+
+// How the driver finds out about finished operations.
+#define DISK_MODE_ADAPTIVE 0 // switch between the two below (default)
+#define DISK_MODE_INTR     1 // the device interrupts
+#define DISK_MODE_POLL     2 // virtio_disk_poll and virtio_disk_start reap
+
+/*
+ * Set the completion mode, one of DISK_MODE_*.
+ */
+void virtio_disk_mode(int mode);
+
+// What the block cache in front of the device does (see bcache.h).
+#define DISK_CACHE_WRITETHROUGH 0 // writes go straight on to the disk (default)
+#define DISK_CACHE_WRITEBACK    1 // 'W' writes are answered from the cache
+#define DISK_CACHE_OFF          2 // every command goes to the disk
+
+/*
+ * Set the block cache mode, one of DISK_CACHE_*. Leaving write-back
+ * mode first writes every dirty block back to the disk. If the
+ * write-backs keep failing, the blocks still dirty are given up on.
+ * Returns: 0, or -1 if dirty blocks were lost.
+ */
+int virtio_disk_cache(int mode);
+
+/*
+ * Set the most blocks the driver reads ahead into the block cache
+ * for a data port that 'R' commands are reading in order. 0 turns
+ * read-ahead off. The driver uses at most DISK_READAHEAD (the
+ * default), and fewer if the cache is small.
+ */
+#define DISK_READAHEAD 32
+void virtio_disk_readahead(int max);
+
+/*
+ * Turn the device's write cache on or off, if it lets the driver
+ * choose (VIRTIO_BLK_F_CONFIG_WCE). It is on from init whenever the
+ * device can flush it. With it on, writes are answered once they are
+ * in the device's cache, and an 'F' command makes them durable.
+ * Send an 'F' before turning it off.
+ * Returns: 1 if the device now caches writes, otherwise 0.
+ */
+int virtio_disk_wcache(int on);
+
+/*
+ * Returns: The size of the disk, in BSIZE blocks. Commands that run
+ *          past the end fail without reaching the device.
+ */
+uint64 virtio_disk_nblocks(void);
+
+/*
+ * Returns: The size of the device's own blocks, a multiple of BSIZE.
+ *          If it is larger than BSIZE, commands must start and end
+ *          on one of them, so single blocks are read and written
+ *          with 'r' and 'w', and the block cache is off.
+ */
+int virtio_disk_blocksize(void);
+
+/*
+ * A block request from inside the kernel, such as a file system or
+ * a swapper. It goes to the device without a command port: nothing
+ * is formatted or parsed, and the device moves the blocks straight
+ * to or from data. Otherwise it is treated as the command it names,
+ * waiting behind an 'F' and keeping the block cache up to date.
+ */
+struct bio {
+  int op;          // DISK_BIO_*
+  uint64 blockid;  // first block, as in a command
+  int nblocks;     // blocks to move, or the length of the range
+  char *data;      // nblocks * BSIZE bytes to read into or write from
+  void (*done)(struct bio *); // called once the bio has finished
+  void *arg;       // for done
+  int status;      // 0 if it worked, otherwise -1
+  struct bio *next; // used by the driver
+};
+
+#define DISK_BIO_READ    0 // as 'r': read nblocks blocks into data
+#define DISK_BIO_WRITE   1 // as 'w': write nblocks blocks from data
+#define DISK_BIO_FLUSH   2 // as 'F'; blockid and nblocks are ignored
+#define DISK_BIO_ZERO    3 // as 'z'; data is ignored
+#define DISK_BIO_DISCARD 4 // as 'd'; data is ignored
+
+/*
+ * Queue bio b and start the disk. A read or write moves at most
+ * MAXRUN blocks (fewer if the device takes few data segments), and
+ * data must stay put until b is done. b->done is called with
+ * interrupts off, from virtio_disk_intr, _poll or _start, and may
+ * submit another bio, which is then started once it returns.
+ * Returns: 0 if b was queued, or -1 if it could never be carried
+ *          out, in which case done is not called.
+ */
+int virtio_disk_submit(struct bio *b);
+
+#define DISK_LAT_BUCKETS 16
+#define DISK_DEPTH_BUCKETS 12
+
+/*
+ * Driver counters, for benchmarks and tuning. Also sent in answer
+ * to a query on PORT_DISKSTAT: 'S' and a 4 character decimal port,
+ * to which the driver writes this struct once it has room for it.
+ */
+struct disk_stats {
+  uint64 requests;   // requests handed to the device
+  uint64 notifies;   // doorbell writes; one covers a batch of requests
+  uint64 interrupts; // calls to virtio_disk_intr
+  uint64 polled;     // requests reaped without an interrupt
+  uint64 switches;   // changes between polling and interrupts
+  uint64 features;   // virtio feature bits negotiated at init
+  uint64 queues;     // virtqueues in use
+  uint64 bytes_read;    // by commands that succeeded, cached or not
+  uint64 bytes_written;
+  uint64 failures;      // commands answered 'F'
+  uint64 stalls;        // times a command waited for ring or buffer space
+  uint64 flushes;       // 'F' commands sent to the device
+  uint64 zeroed;        // blocks zeroed by 'z' commands
+  uint64 discarded;     // and discarded by 'd' commands
+  uint64 segments;      // data descriptors in the requests handed over
+
+  // block cache. misses count blocks read from the device while
+  // the cache was on.
+  uint64 cache_hits;       // 'R' commands answered from the cache
+  uint64 cache_misses;     // blocks that had to be read
+  uint64 cache_absorbed;   // 'W' commands kept in a write-back cache
+  uint64 cache_superseded; // of those, ones replacing a dirty block
+  uint64 cache_writebacks; // dirty blocks written back
+  uint64 writeback_reqs;   // requests they were written back in
+  uint64 writeback_fails;  // write-back requests that failed
+  uint64 writeback_lost;   // dirty blocks given up on, see virtio_disk_cache
+  uint64 readahead;        // blocks read ahead of sequential readers
+  uint64 readahead_hits;   // reads answered by blocks read ahead
+
+  // request latency, from submission to being reaped, by how it was
+  // reaped. bucket i counts latencies of 2^i up to 2^(i+1) r_time()
+  // ticks, and the last bucket also everything longer.
+  uint64 lat_intr[DISK_LAT_BUCKETS];
+  uint64 lat_poll[DISK_LAT_BUCKETS];
+
+  // time from a command being taken off PORT_DISKCMD to its request
+  // being submitted, which for 'w' includes waiting for its data.
+  uint64 lat_queue[DISK_LAT_BUCKETS];
+
+  // requests in flight, sampled as each one is submitted. bucket i
+  // counts depths of 2^i up to 2^(i+1).
+  uint64 depth[DISK_DEPTH_BUCKETS];
+};
+
+/*
+ * Copy the driver's counters into *st.
+ */
+void virtio_disk_stats(struct disk_stats *st);
+
+/*
+ * Time n allocations and frees of a three descriptor chain, with
+ * the rest of depth descriptors taken, for make bench. The disk
+ * must be idle.
+ * Returns the elapsed r_time() ticks, or 0 if the queue is too small.
+ */
+uint64 virtio_disk_bench_alloc(int depth, int n);
+
+/*
+ * Send commands to the first n virtqueues in turn, as n harts each
+ * using their own would, rather than to the current hart's. For
+ * make bench, on a kernel that runs on one hart. 0 goes back to
+ * steering by hart. Returns the number of queues used, which may
+ * be fewer than n.
+ */
+int virtio_disk_spread(int n);
+
 // Some disk definitions
 #define BSIZE 1024  // block size
+#define MAXRUN 16   // most blocks in one disk command
+
+// An ASCII disk command may start with a tag: '#' and a 7 character
+// decimal number, which is echoed at the start of its response. With
+// tags, commands on one message port can be told apart when they
+// finish out of order.
+#define DISK_TAG_LEN 8
+
+// Binary form of a disk command, which may be written to
+// PORT_DISKCMD instead of the ASCII one. It is told apart by
+// its first byte. All fields are little-endian.
+#define DISK_BMSG_MAGIC 0xd5
+
+struct disk_bmsg {
+  uchar magic;      // DISK_BMSG_MAGIC
+  uchar mode;       // 'R', 'W', 'r', 'w', 'F', 'z' or 'd', as in ASCII
+  uint16 nblocks;   // blocks to transfer, for 'r' and 'w', or the
+                    // length of the range, for 'z' and 'd'. ignored
+                    // for 'R', 'W' and 'F', which are one block
+  uint16 data_port; // port to use as the block buffer
+  uint16 msg_port;  // port to write the response to
+  uint32 tag;       // echoed back in the response
+  uint64 blockid;   // first block to operate on
+} __attribute__((packed));
+
+// Response to a binary disk command, written to its message port.
+struct disk_bresp {
+  uchar magic;      // DISK_BMSG_MAGIC
+  uchar mode;       // echoes the command's mode
+  uchar status;     // 'S' for success, 'F' for failure
+  uchar reserved;
+  uint32 tag;       // echoes the command's tag
+  uint64 blockid;   // echoes the command's block id
+} __attribute__((packed));
 
 #endif
@@ -9,6 +9,7 @@
 #include "disk.h"
 #include "string.h"
 #include "tests.h"
+#include "bench.h"
 
 void swtch(struct context *old, struct context *new);
 
@@ -42,6 +43,16 @@ main()
   //test the disk
   disk_test();
 
+  //test the ports, once the disk tests have given theirs back
+  port_test();
+
+  //test a process sleeping on ports
+  proc_test();
+
+#ifdef BENCH
+  disk_bench();
+#endif
+
 
   panic("All done! For now...");
 }
@@ -0,0 +1,312 @@
+//
+// ports: fixed-size byte rings for passing data between the kernel,
+// its devices and processes.
+//
+// this replaces the port.o in libprecompiled.a, with the same
+// struct port and the same behaviour for the calls it had. the
+// rest of port.h lets a caller work on a port's ring in place:
+// the data waiting in a port, or the room left in it, is at most
+// two pieces of the ring, one before it wraps and one after.
+//
+// a port's ring is its own buffer, unless it was acquired with
+// port_acquire_size for more than that, when it is a page from
+// vm_page_alloc until the port is closed. struct port can't say
+// which, since the precompiled syscalls and uart know its layout,
+// so rings[] does. ring sizes are powers of two.
+//
+// port_read_wait and port_write_wait put the process to sleep until
+// the port can take the whole read or write. rings[] also notes
+// whether anyone is asleep on a port, so that port_commit and
+// port_consume only go looking for sleepers to wake when there are
+// some.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "port.h"
+#include "string.h"
+#include "mem.h"
+#include "scheduler.h"
+
+_Static_assert(PORT_MAX_SIZE <= PGSIZE, "a port's ring is at most a page");
+
+struct port ports[NPORT];
+
+static struct {
+  char *buf;
+  int size;
+  char readers; // processes may be asleep waiting for data
+  char writers; // processes may be asleep waiting for room
+} rings[NPORT];
+
+// wake anyone asleep on port for data, or for room if write is set.
+static void
+wakeup(int port, int write)
+{
+  if(write && rings[port].writers){
+    rings[port].writers = 0;
+    wakeup_port(port, 1);
+  } else if(!write && rings[port].readers){
+    rings[port].readers = 0;
+    wakeup_port(port, 0);
+  }
+}
+
+// give port back its own buffer, freeing any page it had.
+static void
+ring_reset(int port)
+{
+  if(rings[port].buf && rings[port].buf != ports[port].buffer)
+    vm_page_free(rings[port].buf);
+  rings[port].buf = ports[port].buffer;
+  rings[port].size = PORT_BUF_SIZE;
+}
+
+void
+port_init(void)
+{
+  // the console and the disk command port are always open.
+  for(int i = 0; i < NPORT; i++){
+    ports[i].free = i > PORT_DISKCMD;
+    ports[i].owner = 0;
+    ports[i].head = ports[i].tail = ports[i].count = 0;
+    ring_reset(i);
+  }
+}
+
+void
+port_close(int port)
+{
+  ports[port].free = 1;
+  ports[port].owner = 0;
+  ports[port].head = ports[port].tail = ports[port].count = 0;
+  ring_reset(port);
+  // they find it closed, and give up.
+  wakeup(port, 0);
+  wakeup(port, 1);
+}
+
+int
+port_acquire(int port, procid_t proc_id)
+{
+  return port_acquire_size(port, proc_id, PORT_BUF_SIZE);
+}
+
+int
+port_acquire_size(int port, procid_t proc_id, int size)
+{
+  int n = PORT_BUF_SIZE;
+  char *buf;
+
+  while(n < size)
+    n *= 2;
+  if(n > PORT_MAX_SIZE)
+    return -1;
+
+  if(port == -1)
+    for(port = 0; port < NPORT && !ports[port].free; port++)
+      ;
+  if(port < 0 || port >= NPORT || !ports[port].free)
+    return -1;
+  if(n > PORT_BUF_SIZE){
+    if((buf = vm_page_alloc()) == 0)
+      return -1;
+    rings[port].buf = buf;
+    rings[port].size = n;
+  }
+  ports[port].free = 0;
+  ports[port].owner = proc_id;
+  return port;
+}
+
+int
+port_size(int port)
+{
+  return rings[port].size;
+}
+
+// the n bytes of port's ring from index off, in span[0] up to the
+// end of the ring and span[1] after it wraps. returns n.
+static int
+ring_spans(int port, int off, int n, struct port_iov span[2])
+{
+  int first = rings[port].size - off;
+
+  if(first > n)
+    first = n;
+  span[0].buf = rings[port].buf + off;
+  span[0].len = first;
+  span[1].buf = rings[port].buf;
+  span[1].len = n - first;
+  return n;
+}
+
+int
+port_peek(int port, struct port_iov span[2])
+{
+  struct port *p = &ports[port];
+
+  if(p->free)
+    return -1;
+  return ring_spans(port, p->head, p->count, span);
+}
+
+int
+port_consume(int port, int n)
+{
+  struct port *p = &ports[port];
+
+  if(p->free)
+    return -1;
+  if(n > p->count)
+    n = p->count;
+  if(n <= 0)
+    return 0;
+  p->head = (p->head + n) & (rings[port].size - 1);
+  p->count -= n;
+  wakeup(port, 1);
+  return n;
+}
+
+int
+port_reserve(int port, struct port_iov span[2])
+{
+  struct port *p = &ports[port];
+
+  if(p->free)
+    return -1;
+  return ring_spans(port, p->tail, rings[port].size - p->count, span);
+}
+
+int
+port_commit(int port, int n)
+{
+  struct port *p = &ports[port];
+
+  if(p->free)
+    return -1;
+  if(n > rings[port].size - p->count)
+    n = rings[port].size - p->count;
+  if(n <= 0)
+    return 0;
+  p->tail = (p->tail + n) & (rings[port].size - 1);
+  p->count += n;
+  wakeup(port, 0);
+  return n;
+}
+
+int
+port_write(int port, char *buf, int n)
+{
+  struct port_iov span[2];
+  int room, done = 0;
+
+  if((room = port_reserve(port, span)) < 0)
+    return -1;
+  if(n > room)
+    n = room;
+  for(int i = 0; i < 2 && done < n; i++){
+    int len = n - done < span[i].len ? n - done : span[i].len;
+    memmove(span[i].buf, buf + done, len);
+    done += len;
+  }
+  return port_commit(port, done);
+}
+
+int
+port_read(int port, char *buf, int n)
+{
+  struct port_iov span[2];
+  int count, done = 0;
+
+  if((count = port_peek(port, span)) < 0)
+    return -1;
+  if(n > count)
+    n = count;
+  for(int i = 0; i < 2 && done < n; i++){
+    int len = n - done < span[i].len ? n - done : span[i].len;
+    memmove(buf + done, span[i].buf, len);
+    done += len;
+  }
+  return port_consume(port, done);
+}
+
+int
+port_writev(int port, struct port_iov *iov, int niov)
+{
+  int n, total = 0;
+
+  if(ports[port].free)
+    return -1;
+  for(int i = 0; i < niov; i++){
+    n = port_write(port, iov[i].buf, iov[i].len);
+    total += n;
+    if(n < iov[i].len)
+      break;
+  }
+  return total;
+}
+
+int
+port_readv(int port, struct port_iov *iov, int niov)
+{
+  int n, total = 0;
+
+  if(ports[port].free)
+    return -1;
+  for(int i = 0; i < niov; i++){
+    n = port_read(port, iov[i].buf, iov[i].len);
+    total += n;
+    if(n < iov[i].len)
+      break;
+  }
+  return total;
+}
+
+int
+port_read_wait(int port, char *buf, int n)
+{
+  int intr = intr_get();
+  int r;
+
+  if(n > rings[port].size)
+    return -1;
+  // interrupts stay off from seeing the port short to being asleep,
+  // so the wakeup can't come in between and be missed.
+  intr_off();
+  while(!ports[port].free && ports[port].count < n){
+    rings[port].readers = 1;
+    sleep_port(port, 0);
+    if(intr){
+      intr_on();
+      intr_off();
+    }
+  }
+  r = port_read(port, buf, n);
+  if(intr)
+    intr_on();
+  return r;
+}
+
+int
+port_write_wait(int port, char *buf, int n)
+{
+  int intr = intr_get();
+  int r;
+
+  if(n > rings[port].size)
+    return -1;
+  intr_off();
+  while(!ports[port].free && rings[port].size - ports[port].count < n){
+    rings[port].writers = 1;
+    sleep_port(port, 1);
+    if(intr){
+      intr_on();
+      intr_off();
+    }
+  }
+  r = port_write(port, buf, n);
+  if(intr)
+    intr_on();
+  return r;
+}
@@ -6,11 +6,13 @@
 // Ports for IPC
 #define NPORT 256          // Number of ports
 #define PORT_BUF_SIZE 1024 // Buffer size per port
+#define PORT_MAX_SIZE 4096 // Largest ring port_acquire_size gives, a page
 
 // Predefined ports
 #define PORT_CONSOLEIN  0 // Serial input
 #define PORT_CONSOLEOUT 1 // Serial output
 #define PORT_DISKCMD    2 // Disk command port
+#define PORT_DISKSTAT   3 // Disk statistics queries, taken by the disk driver
 
 // Possible port uses
 #define PORT_TYPE_FREE 0   // Port is free to allocate
@@ -43,6 +45,30 @@ void port_close(int port);
  */
 int port_acquire(int port, procid_t proc_id);
 
+/*
+ * Acquire a port for a process, as port_acquire does, with room for
+ * at least size bytes. The port holds PORT_BUF_SIZE bytes, or the
+ * next power of two up from size if that is more, in a page that is
+ * freed when the port is closed.
+ * Parameters:
+ *  - port: The port number to acquire (-1 for any port).
+ *  - proc_id: ID of the process that is acquiring the port.
+ *  - size: Number of bytes the port must have room for, at most
+ *          PORT_MAX_SIZE.
+ * Returns:
+ *  - The port number on success, -1 on failure.
+ */
+int port_acquire_size(int port, procid_t proc_id, int size);
+
+/*
+ * Find how many bytes a port can hold.
+ * Parameters:
+ *  - port: The port number to look at.
+ * Returns:
+ *  - The size of the port's ring.
+ */
+int port_size(int port);
+
 /*
  * Write data to a port.
  * If the port is not open, the function returns -1.
@@ -69,6 +95,110 @@ int port_write(int port, char *buf, int n);
  */
 int port_read(int port, char *buf, int n);
 
+/*
+ * Read data from a port, waiting until all n bytes are there. The
+ * calling process sleeps meanwhile, and is woken when data arrives.
+ * If the port is closed while it waits, nothing is read.
+ * Parameters:
+ *  - port: The port number to read from.
+ *  - buf: Pointer to the buffer to store the read data.
+ *  - n: Number of bytes to read, at most the port's size.
+ * Returns:
+ *  - n on success, -1 on failure.
+ */
+int port_read_wait(int port, char *buf, int n);
+
+/*
+ * Write data to a port, waiting until there is room for all n
+ * bytes. The calling process sleeps meanwhile, and is woken when
+ * the port is read.
+ * If the port is closed while it waits, nothing is written.
+ * Parameters:
+ *  - port: The port number to write to.
+ *  - buf: Pointer to the data buffer to write.
+ *  - n: Number of bytes to write, at most the port's size.
+ * Returns:
+ *  - n on success, -1 on failure.
+ */
+int port_write_wait(int port, char *buf, int n);
+
+// A piece of memory: one of an I/O vector, or a piece of a port's ring.
+struct port_iov {
+  char *buf;
+  int len;
+};
+
+/*
+ * Find the data waiting in a port, to read it in place. It is in
+ * span[0], and if the ring wraps, the rest is in span[1], either of
+ * which may be empty. The data stays in the port until
+ * port_consume removes it.
+ * Parameters:
+ *  - port: The port number to look at.
+ *  - span: Where to put the two pieces.
+ * Returns:
+ *  - The number of bytes waiting, -1 on failure.
+ */
+int port_peek(int port, struct port_iov span[2]);
+
+/*
+ * Remove data from a port, as port_read would without copying it.
+ * Parameters:
+ *  - port: The port number to remove from.
+ *  - n: Number of bytes to remove.
+ * Returns:
+ *  - The number of bytes actually removed, -1 on failure.
+ */
+int port_consume(int port, int n);
+
+/*
+ * Find the room left in a port, to write into it in place. It is
+ * in span[0], and if the ring wraps, the rest is in span[1]. What is
+ * written there only becomes part of the port's data once
+ * port_commit adds it.
+ * Parameters:
+ *  - port: The port number to look at.
+ *  - span: Where to put the two pieces.
+ * Returns:
+ *  - The number of bytes of room, -1 on failure.
+ */
+int port_reserve(int port, struct port_iov span[2]);
+
+/*
+ * Add the first n bytes of the room found by port_reserve to a
+ * port's data, as port_write would without copying them.
+ * Parameters:
+ *  - port: The port number to add to.
+ *  - n: Number of bytes to add.
+ * Returns:
+ *  - The number of bytes actually added, -1 on failure.
+ */
+int port_commit(int port, int n);
+
+/*
+ * Write the niov pieces of iov to a port, in order, as far as it
+ * has room.
+ * Parameters:
+ *  - port: The port number to write to.
+ *  - iov: The pieces to write.
+ *  - niov: Number of pieces.
+ * Returns:
+ *  - The number of bytes actually written, -1 on failure.
+ */
+int port_writev(int port, struct port_iov *iov, int niov);
+
+/*
+ * Read from a port into the niov pieces of iov, in order, as far as
+ * it has data.
+ * Parameters:
+ *  - port: The port number to read from.
+ *  - iov: The pieces to fill.
+ *  - niov: Number of pieces.
+ * Returns:
+ *  - The number of bytes actually read, -1 on failure.
+ */
+int port_readv(int port, struct port_iov *iov, int niov);
+
 // Define the Port struct with buffer, head, tail, etc.
 struct port {
   int free;                   // Is port free?
@@ -76,7 +206,7 @@ struct port {
   int type;                   // Type of the port (free or kernel)
   int head, tail;             // Indexes for the circular buffer
   int count;                  // Number of items in buffer
-  char buffer[PORT_BUF_SIZE]; // Data buffer
+  char buffer[PORT_BUF_SIZE]; // Data buffer, unless the port is bigger
 };
 
 // The ports array
@@ -14,6 +14,53 @@ volatile int panicked = 0;
 
 static char digits[] = "0123456789abcdef";
 
+// output is gathered here and written to the port in one go. a
+// message that fits is written whole or not at all, so a full port
+// never gets the front of a disk command without the rest. console
+// output is never dropped: what doesn't fit waits for the uart to
+// send what is in the port.
+#define PBUF_SIZE 128
+
+struct pbuf {
+  int port;
+  int n;       // bytes waiting in buf
+  int partial; // some of the message has already been written
+  char buf[PBUF_SIZE];
+};
+
+static void
+pbuf_flush(struct pbuf *b)
+{
+  struct port_iov span[2];
+  int done = 0, n;
+
+  if(b->port == PORT_CONSOLEOUT){
+    while((n = port_write(b->port, b->buf + done, b->n - done)) >= 0 &&
+          (done += n) < b->n)
+      uartflush();
+  } else if(b->partial || port_reserve(b->port, span) >= b->n){
+    port_write(b->port, b->buf, b->n);
+  }
+  b->n = 0;
+}
+
+static void
+pbuf_put(struct pbuf *b, char *s, int n)
+{
+  while(n > 0){
+    if(b->n == PBUF_SIZE){
+      // too long to keep whole; let it go a piece at a time.
+      b->partial = 1;
+      pbuf_flush(b);
+    }
+    int len = n < PBUF_SIZE - b->n ? n : PBUF_SIZE - b->n;
+    memmove(b->buf + b->n, s, len);
+    b->n += len;
+    s += len;
+    n -= len;
+  }
+}
+
 
 static int get_padding(char *fmt, int *i)
 {
@@ -34,19 +81,19 @@ static int get_padding(char *fmt, int *i)
 }
 
 
-static void print_padding(int port, int padding, int len)
+static void print_padding(struct pbuf *b, int padding, int len)
 {
   if(padding < 0) {
     padding *= -1;
   }
 
   for (int i = 0; i < padding - len; i++)
-    port_write(port, " ", 1);
+    pbuf_put(b, " ", 1);
 }
 
 
 static void
-printint(int port, int xx, int base, int sign, int padding)
+printint(struct pbuf *b, int xx, int base, int sign, int padding)
 {
   char buf[16];
   int i;
@@ -68,17 +115,17 @@ printint(int port, int xx, int base, int sign, int padding)
 
   len = i;
   if(padding > 0)
-    print_padding(port, padding, len);
+    print_padding(b, padding, len);
 
   while(--i >= 0)
-    port_write(port, buf + i, 1);
+    pbuf_put(b, buf + i, 1);
 
   if(padding < 0)
-    print_padding(port, padding, len);
+    print_padding(b, padding, len);
 }
 
 static void
-printptr(int port, uint64 x, int padding)
+printptr(struct pbuf *b, uint64 x, int padding)
 {
   int i;
   char buf[16];
@@ -87,18 +134,18 @@ printptr(int port, uint64 x, int padding)
     buf[i] = digits[x >> (sizeof(uint64) * 8 - 4)];
 
   if(padding > 0)
-    print_padding(port, padding, i+2);
+    print_padding(b, padding, i+2);
 
-  port_write(port, "0x", 2);
-  port_write(port, buf, i);
+  pbuf_put(b, "0x", 2);
+  pbuf_put(b, buf, i);
 
   if(padding < 0)
-    print_padding(port, padding, i+2);
+    print_padding(b, padding, i+2);
 }
 
 
 static void
-printstr(int port, char *s, int padding)
+printstr(struct pbuf *b, char *s, int padding)
 {
   int len;
 
@@ -107,26 +154,25 @@ printstr(int port, char *s, int padding)
   len = strlen(s);
 
   if(padding > 0)
-    print_padding(port, padding, len);
+    print_padding(b, padding, len);
 
-  while(*s)
-    port_write(port, s++, 1);
+  pbuf_put(b, s, len);
 
   if(padding < 0)
-    print_padding(port, padding, len);
+    print_padding(b, padding, len);
 }
 
 
 static void 
-printchar(int port, int c, int padding)
+printchar(struct pbuf *b, int c, int padding)
 {
   if(padding > 0)
-    print_padding(port, padding, 1);
+    print_padding(b, padding, 1);
 
-  port_write(port, (char*)&c, 1);
+  pbuf_put(b, (char*)&c, 1);
 
   if(padding < 0)
-    print_padding(port, padding, 1);
+    print_padding(b, padding, 1);
 }
 
 
@@ -136,13 +182,18 @@ printf_driver(int port, char *fmt, va_list ap)
 {
   int i, c;
   int padding;
+  struct pbuf b;
+
+  b.port = port;
+  b.n = 0;
+  b.partial = 0;
 
   if (fmt == 0)
     panic("null fmt");
 
   for(i = 0; (c = fmt[i] & 0xff) != 0; i++){
     if(c != '%'){
-      port_write(port, (char*) &c, 1);
+      pbuf_put(&b, (char*) &c, 1);
       continue;
     }
     i++;
@@ -152,30 +203,31 @@ printf_driver(int port, char *fmt, va_list ap)
       break;
     switch(c){
     case 'c':
-      printchar(port, va_arg(ap, int), padding);
+      printchar(&b, va_arg(ap, int), padding);
       break;
     case 'd':
-      printint(port, va_arg(ap, int), 10, 1, padding);
+      printint(&b, va_arg(ap, int), 10, 1, padding);
       break;
     case 'x':
-      printint(port, va_arg(ap, int), 16, 1, padding);
+      printint(&b, va_arg(ap, int), 16, 1, padding);
       break;
     case 'p':
-      printptr(port, va_arg(ap, uint64), padding);
+      printptr(&b, va_arg(ap, uint64), padding);
       break;
     case 's':
-      printstr(port, va_arg(ap, char*), padding);
+      printstr(&b, va_arg(ap, char*), padding);
       break;
     case '%':
-      printchar(port, '%', padding);
+      printchar(&b, '%', padding);
       break;
     default:
       // Print unknown % sequence to draw attention.
-      port_write(port, "%", 1);
-      port_write(port, (char*)&c, 1);
+      pbuf_put(&b, "%", 1);
+      pbuf_put(&b, (char*)&c, 1);
       break;
     }
   }
+  pbuf_flush(&b);
 }
 
 void printf(char *fmt, ...)
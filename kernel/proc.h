@@ -86,8 +86,8 @@ enum procstate { UNUSED, USED, WAITING, RUNNABLE, RUNNING };
 // Per-process state
 struct proc {
   enum procstate state; // Process state
-  int wait_read;        // If non-zero, waiting for a port read
-  int wait_write;       // If non-zero, waiting for a port write
+  int wait_read;        // If non-zero, port + 1 of a port it waits to read
+  int wait_write;       // If non-zero, port + 1 of a port it waits to write
   int pid;              // Process ID
 
   // these are private to the process, so p->lock need not be held.
@@ -0,0 +1,107 @@
+//
+// the process scheduler, and sleeping on ports.
+//
+// this replaces the scheduler.o in libprecompiled.a. scheduler and
+// yield behave as they did, except that the scheduler lets
+// interrupts in between rounds, and waits for one when no process
+// is runnable, since only an interrupt can wake a process then. if
+// the disk is being polled, it polls the disk instead.
+//
+// a process waiting for a port is WAITING, with the port's number
+// plus one in wait_read or wait_write, so that port 0 is not 0.
+// the scheduler passes it over until wakeup_port makes it RUNNABLE.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "proc.h"
+#include "scheduler.h"
+#include "console.h"
+#include "disk.h"
+
+void swtch(struct context *old, struct context *new);
+
+void
+scheduler(void)
+{
+  struct proc *p;
+  int found;
+
+  for(;;){
+    // the last process may have left interrupts off. let in any
+    // that are pending, then keep them out while choosing, so that
+    // one can't be missed between finding nothing and the wfi.
+    intr_on();
+    intr_off();
+
+    found = 0;
+    for(p = proc; p < &proc[NPROC]; p++){
+      if(p->state != RUNNABLE)
+        continue;
+      p->state = RUNNING;
+      cpu.proc = p;
+      swtch(&cpu.context, &p->context);
+      cpu.proc = 0;
+      found = 1;
+    }
+    if(found)
+      continue;
+    if(virtio_disk_polled())
+      virtio_disk_poll();
+    else
+      asm volatile("wfi");
+  }
+}
+
+void
+yield(void)
+{
+  struct proc *p = cpu.proc;
+
+  if(p->state == RUNNING)
+    p->state = RUNNABLE;
+  uartstart();
+  virtio_disk_start();
+  swtch(&p->context, &cpu.context);
+}
+
+void
+sleep_port(int port, int write)
+{
+  struct proc *p = cpu.proc;
+
+  // with no process to switch away from, there is nothing else to
+  // run, so help along the only thing that can fill or drain the
+  // port without one.
+  if(p == 0){
+    virtio_disk_poll();
+    return;
+  }
+
+  if(write)
+    p->wait_write = port + 1;
+  else
+    p->wait_read = port + 1;
+  p->state = WAITING;
+  uartstart();
+  virtio_disk_start();
+  swtch(&p->context, &cpu.context);
+}
+
+void
+wakeup_port(int port, int write)
+{
+  struct proc *p;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    if(p->state != WAITING)
+      continue;
+    if(write && p->wait_write == port + 1){
+      p->wait_write = 0;
+      p->state = RUNNABLE;
+    } else if(!write && p->wait_read == port + 1){
+      p->wait_read = 0;
+      p->state = RUNNABLE;
+    }
+  }
+}
@@ -28,4 +28,29 @@ void scheduler(void);
  *   - None
  */
 void yield(void);
+
+/*
+ * Put the running process to sleep until wakeup_port is called for
+ * the port. Call with interrupts off, having found that the port
+ * can't be read or written yet; they are still off on return, and
+ * the caller checks the port again. With no process running, there
+ * is nothing to switch to, and this polls the disk instead.
+ * Parameters:
+ *   - port: The port number to wait on.
+ *   - write: Non-zero to wait for room to write, zero to wait for data.
+ * Returns:
+ *   - None
+ */
+void sleep_port(int port, int write);
+
+/*
+ * Make every process sleeping on a port runnable again.
+ * Parameters:
+ *   - port: The port number that changed.
+ *   - write: Non-zero for writers, now that there is room, zero for
+ *            readers, now that there is data.
+ * Returns:
+ *   - None
+ */
+void wakeup_port(int port, int write);
 #endif
\ No newline at end of file
@@ -4,5 +4,6 @@
 void test_uart();
 void disk_test();
 void port_test(void);
+void proc_test(void);
 
 #endif // TESTS_H
@@ -14,7 +14,9 @@
 #define VIRTIO_MMIO_DEVICE_ID		0x008 // device type; 1 is net, 2 is disk
 #define VIRTIO_MMIO_VENDOR_ID		0x00c // 0x554d4551
 #define VIRTIO_MMIO_DEVICE_FEATURES	0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL	0x014 // which 32 feature bits, write-only
 #define VIRTIO_MMIO_DRIVER_FEATURES	0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL	0x024 // which 32 feature bits, write-only
 #define VIRTIO_MMIO_QUEUE_SEL		0x030 // select queue, write-only
 #define VIRTIO_MMIO_QUEUE_NUM_MAX	0x034 // max size of current queue, read-only
 #define VIRTIO_MMIO_QUEUE_NUM		0x038 // size of current queue, write-only
@@ -29,6 +31,8 @@
 #define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
 #define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // physical address for used ring, write-only
 #define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION	0x0fc // changes when the config space does
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration space
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -37,17 +41,37 @@
 #define VIRTIO_CONFIG_S_FEATURES_OK	8
 
 // device feature bits
+#define VIRTIO_BLK_F_SIZE_MAX        1	/* Largest data segment in size_max */
+#define VIRTIO_BLK_F_SEG_MAX         2	/* Most data segments in seg_max */
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
+#define VIRTIO_BLK_F_BLK_SIZE        6	/* Logical block size in blk_size */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
+#define VIRTIO_BLK_F_FLUSH           9	/* Cache flush command support */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
+#define VIRTIO_BLK_F_DISCARD        13	/* Discard command support */
+#define VIRTIO_BLK_F_WRITE_ZEROES   14	/* Write zeroes command support */
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
+#define VIRTIO_F_RING_PACKED        34
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// at most this many virtio descriptors; the driver uses the
+// largest power of two the device also supports. build with
+// QDEPTH=n to change it. must be a power of two, and no more
+// than 256 so that each ring fits in a single page.
+#ifndef NUM
+#define NUM 256
+#endif
+#if NUM > 256 || (NUM & (NUM - 1)) != 0
+#error "NUM must be a power of two no larger than 256"
+#endif
+
+// at most this many virtqueues, with VIRTIO_BLK_F_MQ.
+#ifndef NQUEUE
+#define NQUEUE 8
+#endif
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -58,10 +82,14 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // buffer is a table of descriptors
+
+// avail ring flags.
+#define VRING_AVAIL_F_NO_INTERRUPT 1 // don't interrupt on completions
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT, or zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
   uint16 unused;
@@ -80,17 +108,66 @@ struct virtq_used {
   struct virtq_used_elem ring[NUM];
 };
 
+// with VIRTIO_F_RING_PACKED there is a single ring of these
+// instead. the driver makes a descriptor available by setting its
+// AVAIL flag to, and its USED flag to the opposite of, its wrap
+// counter; the device marks it used by setting both to its own.
+// the wrap counters start at 1 and flip each time around the ring.
+struct virtq_pdesc {
+  uint64 addr;
+  uint32 len;
+  uint16 id;    // buffer id, echoed back when it is used
+  uint16 flags; // VRING_DESC_F_* and the two below
+};
+#define VRING_PACKED_DESC_F_AVAIL (1 << 7)
+#define VRING_PACKED_DESC_F_USED  (1 << 15)
+
+// packed ring event suppression. the driver's tells the device
+// when to interrupt, and the device's tells the driver when to
+// notify. off_wrap is a ring position, with the wrap counter in
+// the top bit, at which to send the event with FLAG_DESC.
+struct virtq_event {
+  uint16 off_wrap;
+  uint16 flags;
+};
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2 // needs VIRTIO_RING_F_EVENT_IDX
+
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
-#define VIRTIO_BLK_T_IN  0 // read the disk
-#define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_IN            0 // read the disk
+#define VIRTIO_BLK_T_OUT           1 // write the disk
+#define VIRTIO_BLK_T_FLUSH         4 // make earlier writes durable
+#define VIRTIO_BLK_T_DISCARD      11 // forget ranges of sectors
+#define VIRTIO_BLK_T_WRITE_ZEROES 13 // zero ranges of sectors
+
+// offsets in the block device's configuration space.
+#define VIRTIO_BLK_CONFIG_CAPACITY      0 // uint64, in 512-byte sectors
+#define VIRTIO_BLK_CONFIG_SIZE_MAX      8 // uint32, with VIRTIO_BLK_F_SIZE_MAX
+#define VIRTIO_BLK_CONFIG_SEG_MAX      12 // uint32, with VIRTIO_BLK_F_SEG_MAX
+#define VIRTIO_BLK_CONFIG_BLK_SIZE     20 // uint32, with VIRTIO_BLK_F_BLK_SIZE
+#define VIRTIO_BLK_CONFIG_WRITEBACK    32 // uint8, with VIRTIO_BLK_F_CONFIG_WCE
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES   34 // uint16, with VIRTIO_BLK_F_MQ
+#define VIRTIO_BLK_CONFIG_MAX_DISCARD  36 // uint32 sectors, with ..._F_DISCARD
+#define VIRTIO_BLK_CONFIG_MAX_ZEROES   48 // uint32 sectors, with ..._F_WRITE_ZEROES
+#define VIRTIO_BLK_CONFIG_ZEROES_UNMAP 56 // uint8, with VIRTIO_BLK_F_WRITE_ZEROES
 
 // the format of the first descriptor in a disk request.
 // to be followed by two more descriptors containing
 // the block, and a one-byte status.
 struct virtio_blk_req {
-  uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
+  uint32 type; // one of VIRTIO_BLK_T_*
   uint32 reserved;
   uint64 sector;
 };
+
+// the data of a VIRTIO_BLK_T_DISCARD or _WRITE_ZEROES request:
+// one of these for each range of sectors.
+struct virtio_blk_dwz {
+  uint64 sector;
+  uint32 num_sectors;
+  uint32 flags;
+};
+#define VIRTIO_BLK_DWZ_F_UNMAP 1 // zeroes may be left unallocated
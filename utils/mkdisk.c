@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -10,7 +9,6 @@ int main(int argc, char **argv)
 {
     int fd = -1;
     int blocks = 0;
-    char buf[BSIZE];
 
     // check for proper usage
     if (argc != 3) {
@@ -24,18 +22,15 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    // generate a block of zeroes
-    memset(buf, 0, BSIZE);
-
     // get the number of blocks
     blocks = atoi(argv[2]);
 
-    // write the blocks to the file
-    for (int i = 0; i < blocks; i++) {
-        if (write(fd, buf, BSIZE) != BSIZE) {
-            perror("write");
-            exit(1);
-        }
+    // size the file, which reads back as zeroes without having to
+    // write them (and on most file systems takes no space until the
+    // blocks are written)
+    if (ftruncate(fd, (off_t) blocks * BSIZE) < 0) {
+        perror("ftruncate");
+        exit(1);
     }
 
     close(fd);